@@ -0,0 +1,111 @@
+/**
+ * @file    mpool_bench.c
+ * @author  ln
+ * @brief   内存池的多线程测试：无锁模式（MPOOL_ATTR_LOCKFREE）与加锁的自增长模式（MPOOL_MODE_DGROWN）对比
+ *
+ *          用法：mpool_bench [最大线程数] [每线程分配次数] [块大小] [每批块数]，默认为 32 1000000 64 16；
+ *          线程数取1、2、4 ... 直到最大线程数，每个线程反复分配一批块再全部释放，
+ *          每组输出百万次分配加释放每秒（Mop/s），另测开启线程缓存的自增长模式作参照
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "../lib/mpool.h"
+#include "../lib/timetick.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// 线程缓存的块数
+#define BENCH_MAG_SIZE          64
+
+typedef struct {
+    mpool_t     *mpool;
+    long        n;          ///< 本线程的分配次数
+    size_t      size;       ///< 块大小
+    int         batch;      ///< 每批分配的块数
+} bench_arg_t;
+
+static void* bench_worker(void *arg)
+{
+    bench_arg_t *ba = (bench_arg_t *)arg;
+    void *ptrs[ba->batch];
+    for (long i=0; i<ba->n; i+=ba->batch) {
+        for (int j=0; j<ba->batch; j++) {
+            if ((ptrs[j] = mpool_malloc(ba->mpool, ba->size)) == NULL) {
+                perror("mpool_malloc");
+                exit(EXIT_FAILURE);
+            }
+            *(char *)ptrs[j] = (char)j;
+        }
+        for (int j=0; j<ba->batch; j++)
+            mpool_free(ba->mpool, ptrs[j]);
+    }
+    return NULL;
+}
+
+/**
+ * @brief   测一组线程的分配吞吐量
+ * @param   attr    内存池属性
+ *          nthr    线程数
+ *          n       每线程分配次数（按每批块数取整）
+ *          size    块大小
+ *          batch   每批块数
+ *
+ * @return  成功返回百万次分配加释放每秒，失败返回-1
+ */
+static double bench_run(const mpool_attr_t *attr, int nthr, long n, size_t size, int batch)
+{
+    mpool_t mpool;
+    if (mpool_init_ex(&mpool, size, 0, NULL, attr) != 0)
+        return -1;
+
+    n = n / batch * batch;
+    pthread_t tid[nthr];
+    bench_arg_t arg = {&mpool, n, size, batch};
+
+    double start = monotime();
+    for (int i=0; i<nthr; i++)
+        pthread_create(&tid[i], NULL, bench_worker, &arg);
+    for (int i=0; i<nthr; i++)
+        pthread_join(tid[i], NULL);
+    double elapsed = monotime() - start;
+
+    mpool_destroy(&mpool);
+    return n * nthr / elapsed / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+    int nmax = (argc > 1) ? atoi(argv[1]) : 32;
+    long n = (argc > 2) ? atol(argv[2]) : 1000000;
+    size_t size = (argc > 3) ? (size_t)atol(argv[3]) : 64;
+    int batch = (argc > 4) ? atoi(argv[4]) : 16;
+    if (nmax <= 0 || n <= 0 || size == 0 || batch <= 0 || batch > n) {
+        fprintf(stderr, "Usage: %s [max_threads] [allocs_per_thread] [block_size] [batch]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    mpool_attr_t locked, lockfree, magazine;
+    mpool_attr_init(&locked);
+    mpool_attr_init(&lockfree);
+    lockfree.flags = MPOOL_ATTR_LOCKFREE;
+    mpool_attr_init(&magazine);
+    magazine.mag_size = BENCH_MAG_SIZE;
+
+    printf("%d threads max, %ld allocs of %zu bytes per thread in batches of %d, Mop/s\n", nmax, n, size, batch);
+    printf("%8s %10s %10s %10s\n", "threads", "dgrown", "lockfree", "magazine");
+    for (int nthr=1; nthr<=nmax; nthr*=2) {
+        printf("%8d %10.2f %10.2f %10.2f\n", nthr,
+               bench_run(&locked, nthr, n, size, batch),
+               bench_run(&lockfree, nthr, n, size, batch),
+               bench_run(&magazine, nthr, n, size, batch));
+    }
+    return EXIT_SUCCESS;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,136 @@
+/**
+ * @file    thrq_bench.c
+ * @author  ln
+ * @brief   线程队列的扩展性测试：1..N个生产者与1..N个消费者分别在链表模式与环形队列模式下的吞吐量
+ *
+ *          用法：thrq_bench [最大线程数] [每组消息数] [消息长度]，默认为 8 1000000 64；
+ *          生产者数与消费者数分别取1、2、4 ... 直到最大线程数，单生产者单消费者时另测SPSC模式，
+ *          每组输出百万条消息每秒（Mmsg/s）
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../lib/thrq.h"
+#include "../lib/timetick.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// 环形队列的槽数
+#define BENCH_RING_SLOTS        1024
+
+typedef struct {
+    thrq_cb_t   *thrq;
+    long        n;          ///< 本线程收发的消息条数
+    size_t      len;        ///< 消息长度
+} bench_arg_t;
+
+static void* bench_producer(void *arg)
+{
+    bench_arg_t *ba = (bench_arg_t *)arg;
+    unsigned char *msg = (unsigned char *)calloc(1, ba->len);
+    for (long i=0; i<ba->n; i++) {
+        memcpy(msg, &i, sizeof(i) < ba->len ? sizeof(i) : ba->len);
+        while (thrq_send(ba->thrq, msg, ba->len, 0) != 0)
+            thrd_yield();
+    }
+    free(msg);
+    return NULL;
+}
+
+static void* bench_consumer(void *arg)
+{
+    bench_arg_t *ba = (bench_arg_t *)arg;
+    unsigned char *buf = (unsigned char *)malloc(ba->len);
+    for (long i=0; i<ba->n; i++) {
+        if (thrq_receive(ba->thrq, buf, ba->len, 0, 0) < 0) {
+            perror("thrq_receive");
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+/**
+ * @brief   测一组生产者与消费者的吞吐量
+ * @param   mode    THRQ_MODE_LIST / THRQ_MODE_SPSC / THRQ_MODE_MPMC
+ *          np      生产者数
+ *          nc      消费者数
+ *          total   消息总数（按生产者数取整）
+ *          len     消息长度
+ *
+ * @return  成功返回百万条消息每秒，失败返回-1
+ */
+static double bench_run(int mode, int np, int nc, long total, size_t len)
+{
+    thrq_cb_t thrq;
+    int res;
+    if (mode == THRQ_MODE_SPSC)
+        res = thrq_init_spsc(&thrq, len, BENCH_RING_SLOTS);
+    else if (mode == THRQ_MODE_MPMC)
+        res = thrq_init_mpmc(&thrq, len, BENCH_RING_SLOTS);
+    else
+        res = thrq_init(&thrq, NULL);
+    if (res != 0)
+        return -1;
+
+    long per = total / np;
+    total = per * np;
+    pthread_t tid[np + nc];
+    bench_arg_t arg[np + nc];
+    for (int i=0; i<nc; i++) {
+        arg[np + i].thrq = &thrq;
+        arg[np + i].n = total / nc + (i < total % nc);
+        arg[np + i].len = len;
+    }
+    for (int i=0; i<np; i++) {
+        arg[i].thrq = &thrq;
+        arg[i].n = per;
+        arg[i].len = len;
+    }
+
+    double start = monotime();
+    for (int i=0; i<nc; i++)
+        pthread_create(&tid[np + i], NULL, bench_consumer, &arg[np + i]);
+    for (int i=0; i<np; i++)
+        pthread_create(&tid[i], NULL, bench_producer, &arg[i]);
+    for (int i=0; i<np + nc; i++)
+        pthread_join(tid[i], NULL);
+    double elapsed = monotime() - start;
+
+    thrq_destroy(&thrq);
+    return total / elapsed / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+    int nmax = (argc > 1) ? atoi(argv[1]) : 8;
+    long total = (argc > 2) ? atol(argv[2]) : 1000000;
+    size_t len = (argc > 3) ? (size_t)atol(argv[3]) : 64;
+    if (nmax <= 0 || total <= 0 || len == 0) {
+        fprintf(stderr, "Usage: %s [max_threads] [msgs] [msg_len]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("%d threads max, %ld msgs of %zu bytes per run, Mmsg/s\n", nmax, total, len);
+    printf("%8s %8s %10s %10s %10s\n", "prod", "cons", "list", "mpmc", "spsc");
+    for (int np=1; np<=nmax; np*=2) {
+        for (int nc=1; nc<=nmax; nc*=2) {
+            double list = bench_run(THRQ_MODE_LIST, np, nc, total, len);
+            double mpmc = bench_run(THRQ_MODE_MPMC, np, nc, total, len);
+            printf("%8d %8d %10.2f %10.2f", np, nc, list, mpmc);
+            if (np == 1 && nc == 1)
+                printf(" %10.2f", bench_run(THRQ_MODE_SPSC, np, nc, total, len));
+            printf("\n");
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -106,7 +106,7 @@ int common_wait_exit(void)
  */
 void common_exit(int ec)
 {
-    thrq_send(&cinfo.thrq_start, &ec, sizeof(ec), 0);
+    thrq_send_prio(&cinfo.thrq_start, &ec, sizeof(ec), THRQ_PRIO_URGENT, 0);
     COMMON_RETIRE();
 }
 
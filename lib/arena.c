@@ -0,0 +1,216 @@
+/**
+ * @file    arena.c
+ * @author  ln
+ * @brief   线性（bump-pointer）内存分配器，适合“一次请求内的多次小分配，请求结束后整体释放”的场景\n
+ *
+ *          分配只是把当前位置向后移动，不能单独释放某一块；内存按页向系统申请，用完一块再申请下一块，
+ *          arena_reset后所有块都保留下来，下一轮请求直接复用，所以重置是O(1)的
+ *
+ *          arena_mark/arena_rewind可以记录并回退到某个位置，用于释放一段临时的分配
+ *
+ *          使用时只需要先初始化arena_init，之后便可以进行“分配”arena_malloc与“重置”arena_reset
+ *
+ * @attention   非线程安全
+ */
+
+#include "arena.h"
+#include "err.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// 长度按a对齐（a必须是2的幂）
+#define ARENA_ALIGN_UP(len, a)      (((len) + ((a)-1)) & ~((size_t)(a)-1))
+/// 块的数据区起始位置（已对齐）
+#define ARENA_CHUNK_BEGIN(c)        ((char *)ARENA_ALIGN_UP((size_t)(c)->data, ARENA_ALIGN))
+
+/**
+ * @brief   初始化线性分配器，初始化时不申请内存，第一次分配时才申请
+ * @param   arena       分配器对象
+ *          chunk_size  每次向系统申请的大小，向上按页对齐，0表示ARENA_CHUNK_SIZE_DEF
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ */
+int arena_init(arena_t *arena, size_t chunk_size)
+{
+    if (arena == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    long page = sysconf(_SC_PAGESIZE);
+    if (page <= 0)
+        page = 4096;
+    if (chunk_size == 0)
+        chunk_size = ARENA_CHUNK_SIZE_DEF;
+
+    TAILQ_INIT(&arena->hdr_chunk);
+    arena->cur = NULL;
+    arena->pos = NULL;
+    arena->chunk_size = ARENA_ALIGN_UP(chunk_size, (size_t)page);
+    return 0;
+}
+
+/**
+ * @brief   新建线性分配器
+ * @param   chunk_size  每次向系统申请的大小，0表示ARENA_CHUNK_SIZE_DEF
+ *
+ * @return      成功返回分配器对象指针，失败返回NULL
+ * @attention   返回的对象需要free
+ */
+arena_t* arena_new(size_t chunk_size)
+{
+    arena_t *arena = (arena_t *)malloc(sizeof(arena_t));
+    if (arena == NULL)
+        return NULL;
+
+    if (arena_init(arena, chunk_size) != 0) {
+        free(arena);
+        arena = NULL;
+    }
+    return arena;
+}
+
+/**
+ * @brief   销毁线性分配器，释放所有向系统申请的内存
+ * @param   arena   分配器对象
+ * @return  成功返回0，失败返回-1并设置errno
+ */
+int arena_destroy(arena_t *arena)
+{
+    if (arena == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    arena_chunk_t *c;
+    while (!TAILQ_EMPTY(&arena->hdr_chunk)) {
+        c = TAILQ_FIRST(&arena->hdr_chunk);
+        TAILQ_REMOVE(&arena->hdr_chunk, c, entry);
+        free(c);
+    }
+    arena->cur = NULL;
+    arena->pos = NULL;
+    return 0;
+}
+
+/**
+ * @brief   内部函数，找到能容纳size字节的下一个块，并将其设为当前块
+ * @param   arena   分配器对象
+ *          size    要分配的大小（已对齐）
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ *
+ * @note    优先复用当前块之后的空闲块，都放不下时才向系统申请新块，新块插在当前块之后
+ */
+static int arena_next_chunk(arena_t *arena, size_t size)
+{
+    arena_chunk_t *c = arena->cur ? TAILQ_NEXT(arena->cur, entry) : TAILQ_FIRST(&arena->hdr_chunk);
+    if (c && (size_t)(c->end - ARENA_CHUNK_BEGIN(c)) >= size) {
+        arena->cur = c;
+        arena->pos = ARENA_CHUNK_BEGIN(c);
+        return 0;
+    }
+
+    size_t len = sizeof(arena_chunk_t) + ARENA_ALIGN + size;
+    if (len < arena->chunk_size)
+        len = arena->chunk_size;
+    else
+        len = ARENA_ALIGN_UP(len, arena->chunk_size);
+
+    c = (arena_chunk_t *)malloc(len);
+    if (c == NULL)
+        return -1;
+    c->end = (char *)c + len;
+    if (arena->cur)
+        TAILQ_INSERT_AFTER(&arena->hdr_chunk, arena->cur, c, entry);
+    else
+        TAILQ_INSERT_HEAD(&arena->hdr_chunk, c, entry);
+    arena->cur = c;
+    arena->pos = ARENA_CHUNK_BEGIN(c);
+    return 0;
+}
+
+/**
+ * @brief   分配数据
+ * @param   arena   分配器对象
+ *          size    想要分配的数据大小
+ *
+ * @return  成功返回有效数据的指针（按ARENA_ALIGN对齐），失败返回NULL并设置errno
+ *
+ * @attention   返回的指针不能单独释放，只能通过arena_rewind/arena_reset/arena_destroy整体回收
+ */
+void* arena_malloc(arena_t *arena, size_t size)
+{
+    if (arena == NULL || size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size = ARENA_ALIGN_UP(size, ARENA_ALIGN);
+    if (arena->cur == NULL || (size_t)(arena->cur->end - arena->pos) < size) {
+        if (arena_next_chunk(arena, size) != 0)
+            return NULL;
+    }
+
+    void *p = arena->pos;
+    arena->pos += size;
+    return p;
+}
+
+/**
+ * @brief   记录当前的分配位置
+ * @param   arena   分配器对象
+ * @return  当前的分配位置，供arena_rewind使用；arena为NULL时返回全零的位置
+ */
+arena_mark_t arena_mark(arena_t *arena)
+{
+    arena_mark_t mark = { NULL, NULL };
+    if (arena == NULL)
+        return mark;
+    mark.cur = arena->cur;
+    mark.pos = arena->pos;
+    return mark;
+}
+
+/**
+ * @brief   回退到arena_mark所记录的位置，之后分配的数据全部作废
+ * @param   arena   分配器对象
+ *          mark    arena_mark的返回值
+ *
+ * @return  void
+ *
+ * @attention   mark之后不能有arena_reset，否则mark已经失效
+ */
+void arena_rewind(arena_t *arena, arena_mark_t mark)
+{
+    if (arena == NULL)
+        return;
+    if (mark.cur == NULL) {
+        arena_reset(arena);
+        return;
+    }
+    arena->cur = mark.cur;
+    arena->pos = mark.pos;
+}
+
+/**
+ * @brief   重置分配器，之前分配的数据全部作废，向系统申请的内存保留下来供下次复用
+ * @param   arena   分配器对象
+ * @return  void
+ */
+void arena_reset(arena_t *arena)
+{
+    if (arena == NULL)
+        return;
+    arena->cur = NULL;
+    arena->pos = NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
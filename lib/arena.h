@@ -0,0 +1,69 @@
+/**
+ * @file    arena.h
+ * @author  ln
+ * @brief   线性（bump-pointer）内存分配器，适合“一次请求内的多次小分配，请求结束后整体释放”的场景\n
+ *
+ *          分配只是把当前位置向后移动，不能单独释放某一块；内存按页向系统申请，用完一块再申请下一块，
+ *          arena_reset后所有块都保留下来，下一轮请求直接复用，所以重置是O(1)的
+ *
+ *          arena_mark/arena_rewind可以记录并回退到某个位置，用于释放一段临时的分配
+ *
+ *          使用时只需要先初始化arena_init，之后便可以进行“分配”arena_malloc与“重置”arena_reset
+ *
+ * @attention   非线程安全
+ */
+
+#ifndef __ARENA__
+#define __ARENA__
+
+#include <stddef.h>
+#include "sysque.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// 默认每次向系统申请的大小（按页对齐）
+#define ARENA_CHUNK_SIZE_DEF    4096
+/// 分配的数据按此对齐
+#define ARENA_ALIGN             (2 * sizeof(void *))
+
+/// 向系统申请的一块内存
+typedef struct __arena_chunk {
+    TAILQ_ENTRY(__arena_chunk)  entry;      ///< 链表元素的表头
+    char                        *end;       ///< 块的结束位置
+    char                        data[];     ///< 块的数据区
+} arena_chunk_t;
+
+typedef TAILQ_HEAD(__arena_chunk_head, __arena_chunk) arena_chunk_head_t;
+
+typedef struct {
+    arena_chunk_head_t  hdr_chunk;      ///< 所有块，按使用顺序排列；当前块之后的块是空闲的，等待复用
+    arena_chunk_t       *cur;           ///< 当前块
+    char                *pos;           ///< 当前块中的分配位置
+    size_t              chunk_size;     ///< 每次向系统申请的大小
+} arena_t;
+
+/// arena_mark所记录的位置
+typedef struct {
+    arena_chunk_t       *cur;           ///< 当前块
+    char                *pos;           ///< 当前块中的分配位置
+} arena_mark_t;
+
+#define ARENA_INIT(a)           arena_init(a,0)
+
+extern int          arena_init(arena_t *arena, size_t chunk_size);
+extern arena_t*     arena_new(size_t chunk_size);
+extern int          arena_destroy(arena_t *arena);
+
+extern void*        arena_malloc(arena_t *arena, size_t size);
+
+extern arena_mark_t arena_mark(arena_t *arena);
+extern void         arena_rewind(arena_t *arena, arena_mark_t mark);
+extern void         arena_reset(arena_t *arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,453 @@
+/**
+ * @file    bcq.c
+ * @author  ln
+ * @brief   广播队列（发布/订阅），一条消息只保存一份，由所有订阅者共享\n
+ *
+ *          所有订阅者都按发布顺序读取，所以引用计数为0的消息总是位于队首，释放时只需从队首开始
+ */
+
+#include "bcq.h"
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BCQ_DATA_MSG(data)      ((bcq_msg_t *)((unsigned char *)(data) - offsetof(bcq_msg_t, data)))
+
+/**
+ * @brief   初始化广播队列
+ * @param   bcq         广播队列
+ *          capacity    最多保留的消息条数，0表示BCQ_CAPACITY_DEF
+ *          slab        多规格分配器指针，当为NULL时，采用malloc和free
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ */
+int bcq_init(bcq_t *bcq, int capacity, mslab_t *slab)
+{
+    if (bcq == NULL || capacity < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (mtx_init(&bcq->lock, mtx_plain) == thrd_error)
+        return -1;
+    if (cnd_init(&bcq->cond) == thrd_error) {
+        mtx_destroy(&bcq->lock);
+        return -1;
+    }
+    if (cnd_init(&bcq->space) == thrd_error) {
+        cnd_destroy(&bcq->cond);
+        mtx_destroy(&bcq->lock);
+        return -1;
+    }
+
+    bcq->mslab = slab;
+    TAILQ_INIT(&bcq->msgs);
+    TAILQ_INIT(&bcq->borrowed);
+    bcq->count = 0;
+    bcq->capacity = capacity ? capacity : BCQ_CAPACITY_DEF;
+    TAILQ_INIT(&bcq->subs);
+    bcq->nsubs = 0;
+    bcq->nwait = 0;
+    bcq->nwait_pub = 0;
+    return 0;
+}
+
+/**
+ * @brief   内部函数，释放消息的内存
+ */
+static void bcq_msg_free(bcq_t *bcq, bcq_msg_t *msg)
+{
+    if (bcq->mslab)
+        mslab_free(bcq->mslab, msg);
+    else
+        free(msg);
+}
+
+/**
+ * @brief   内部函数，释放队首引用计数为0的消息（须持有锁）
+ * @param   bcq     广播队列
+ * @return  void
+ */
+static void bcq_reap(bcq_t *bcq)
+{
+    bcq_msg_t *msg;
+    while ((msg = TAILQ_FIRST(&bcq->msgs)) != NULL && msg->refcnt == 0) {
+        TAILQ_REMOVE(&bcq->msgs, msg, entry);
+        bcq_msg_free(bcq, msg);
+        bcq->count--;
+    }
+}
+
+/**
+ * @brief   内部函数，订阅者读完（或归还）一条消息，减少其引用计数（须持有锁）
+ * @param   bcq     广播队列
+ *          msg     消息
+ * @return  void
+ *
+ * @note    即使消息未被释放，队首消息少了一个引用也可能让bcq_make_room能够丢弃它，所以有发布者等待时都要唤醒
+ */
+static void bcq_unref(bcq_t *bcq, bcq_msg_t *msg)
+{
+    if (msg->lent) {            // already out of the queue, does not hold any room
+        if (--msg->refcnt == 0) {
+            TAILQ_REMOVE(&bcq->borrowed, msg, entry);
+            bcq_msg_free(bcq, msg);
+        }
+        return;
+    }
+
+    bool head = (msg == TAILQ_FIRST(&bcq->msgs));
+    msg->refcnt--;
+    bcq_reap(bcq);
+    if (head && bcq->nwait_pub > 0)
+        cnd_broadcast(&bcq->space);
+}
+
+/**
+ * @brief   内部函数，把相对超时转换为条件变量使用的绝对时刻
+ */
+static void bcq_abstime(struct timespec *ts, double timeout)
+{
+    timespec_get(ts, TIME_MONO);
+    // ok, max_long_int = 2.1s > (1s + 1s)
+    ts->tv_nsec = (long)((timeout - (long)timeout) * 1000000000L) + ts->tv_nsec;
+    ts->tv_sec = (time_t)timeout + ts->tv_sec + (ts->tv_nsec / 1000000000L);
+    ts->tv_nsec = ts->tv_nsec % 1000000000L;
+}
+
+/**
+ * @brief   销毁广播队列，释放所有消息和订阅者
+ * @param   bcq     广播队列
+ * @return  void
+ *
+ * @attention   销毁前所有订阅者和发布者都必须已停止使用该队列
+ */
+void bcq_destroy(bcq_t *bcq)
+{
+    if (bcq == NULL)
+        return;
+
+    mtx_lock(&bcq->lock);
+    bcq_msg_t *msg;
+    while ((msg = TAILQ_FIRST(&bcq->msgs)) != NULL) {
+        TAILQ_REMOVE(&bcq->msgs, msg, entry);
+        bcq_msg_free(bcq, msg);
+    }
+    while ((msg = TAILQ_FIRST(&bcq->borrowed)) != NULL) {
+        TAILQ_REMOVE(&bcq->borrowed, msg, entry);
+        bcq_msg_free(bcq, msg);
+    }
+    bcq_sub_t *sub;
+    while ((sub = TAILQ_FIRST(&bcq->subs)) != NULL) {
+        TAILQ_REMOVE(&bcq->subs, sub, entry);
+        free(sub);
+    }
+    bcq->count = 0;
+    bcq->nsubs = 0;
+    mtx_unlock(&bcq->lock);
+
+    cnd_destroy(&bcq->space);
+    cnd_destroy(&bcq->cond);
+    mtx_destroy(&bcq->lock);
+}
+
+/**
+ * @brief   订阅广播队列
+ * @param   bcq     广播队列
+ *          policy  跟不上时的策略，BCQ_DROP或BCQ_BLOCK
+ *
+ * @return  成功返回订阅者，失败返回NULL并设置errno
+ *
+ * @note    订阅者只能收到订阅之后发布的消息
+ */
+bcq_sub_t* bcq_subscribe(bcq_t *bcq, int policy)
+{
+    if (bcq == NULL || (policy != BCQ_DROP && policy != BCQ_BLOCK)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    bcq_sub_t *sub = (bcq_sub_t *)malloc(sizeof(bcq_sub_t));
+    if (sub == NULL)
+        return NULL;
+    sub->bcq = bcq;
+    sub->next = NULL;
+    sub->policy = policy;
+    sub->received = 0;
+    sub->dropped = 0;
+
+    mtx_lock(&bcq->lock);
+    TAILQ_INSERT_TAIL(&bcq->subs, sub, entry);
+    bcq->nsubs++;
+    mtx_unlock(&bcq->lock);
+    return sub;
+}
+
+/**
+ * @brief   取消订阅，未读的消息不再计入该订阅者的引用
+ * @param   sub     订阅者，返回后不能再使用
+ * @return  void
+ *
+ * @attention   取消订阅前必须先bcq_release所有借出的消息
+ */
+void bcq_unsubscribe(bcq_sub_t *sub)
+{
+    if (sub == NULL)
+        return;
+
+    bcq_t *bcq = sub->bcq;
+    mtx_lock(&bcq->lock);
+    for (bcq_msg_t *msg = sub->next; msg; msg = TAILQ_NEXT(msg, entry))
+        msg->refcnt--;
+    TAILQ_REMOVE(&bcq->subs, sub, entry);
+    bcq->nsubs--;
+    bcq_reap(bcq);
+    if (bcq->nwait_pub > 0)     // a BCQ_BLOCK subscriber may have been holding the publishers back
+        cnd_broadcast(&bcq->space);
+    mtx_unlock(&bcq->lock);
+    free(sub);
+}
+
+/**
+ * @brief   内部函数，队列满时让BCQ_DROP订阅者丢弃最旧的消息，腾出空位（须持有锁）
+ * @param   bcq     广播队列
+ *
+ * @return  腾出空位返回true；最旧的消息仍有BCQ_BLOCK订阅者未读时返回false，此时不修改任何订阅者的状态
+ *
+ * @note    最旧的消息丢弃后若仍被借出，则移到borrowed链表，不再占用队列的容量，归还时释放
+ */
+static bool bcq_make_room(bcq_t *bcq)
+{
+    while (bcq->count >= bcq->capacity) {
+        bcq_msg_t *head = TAILQ_FIRST(&bcq->msgs);
+        bcq_sub_t *sub;
+        /* not yet read by a BCQ_BLOCK subscriber, leave the DROP subscribers untouched */
+        TAILQ_FOREACH(sub, &bcq->subs, entry) {
+            if (sub->policy == BCQ_BLOCK && sub->next == head)
+                return false;
+        }
+        TAILQ_FOREACH(sub, &bcq->subs, entry) {
+            if (sub->next == head) {
+                sub->next = TAILQ_NEXT(head, entry);
+                sub->dropped++;
+                head->refcnt--;
+            }
+        }
+        if (head->refcnt > 0) {     // only borrows left, keep the memory until they are released
+            TAILQ_REMOVE(&bcq->msgs, head, entry);
+            TAILQ_INSERT_TAIL(&bcq->borrowed, head, entry);
+            head->lent = true;
+            bcq->count--;
+        }
+        bcq_reap(bcq);
+    }
+    return true;
+}
+
+/**
+ * @brief   发布消息，消息被拷贝一次，由所有订阅者共享
+ * @param   bcq         广播队列
+ *          data        消息数据
+ *          len         消息长度
+ *          timeout     队列满且有BCQ_BLOCK订阅者未读时的等待超时，单位为秒，0表示一直阻塞
+ *          flags       阻塞标志：0表示阻塞，BCQ_NOWAIT表示不阻塞（队列满时返回LIB_ERRNO_QUE_FULL）
+ *
+ * @return  成功返回收到该消息的订阅者个数（没有订阅者时消息被丢弃，返回0），失败返回-1并设置errno（超时为ETIMEDOUT）
+ */
+int bcq_publish(bcq_t *bcq, const void *data, size_t len, double timeout, int flags)
+{
+    if (bcq == NULL || data == NULL || len == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct timespec ts;
+    if (timeout > 0)
+        bcq_abstime(&ts, timeout);
+
+    mtx_lock(&bcq->lock);
+    if (bcq->nsubs == 0) {
+        mtx_unlock(&bcq->lock);
+        return 0;
+    }
+
+    int res = 0;
+    while (res == 0 && !bcq_make_room(bcq)) {
+        if (flags == BCQ_NOWAIT) {
+            mtx_unlock(&bcq->lock);
+            errno = LIB_ERRNO_QUE_FULL;
+            return -1;
+        }
+        bcq->nwait_pub++;
+        if (timeout > 0) {
+            res = cnd_timedwait(&bcq->space, &bcq->lock, &ts);
+        } else {
+            res = cnd_wait(&bcq->space, &bcq->lock);
+        }
+        bcq->nwait_pub--;
+    }
+    if (res != 0) {
+        mtx_unlock(&bcq->lock);
+        errno = (res == thrd_timeout || res == thrd_busy) ? ETIMEDOUT : EINVAL;
+        return -1;
+    }
+    if (bcq->nsubs == 0) {      // every subscriber left while we waited
+        mtx_unlock(&bcq->lock);
+        return 0;
+    }
+
+    bcq_msg_t *msg = (bcq_msg_t *)(bcq->mslab ? mslab_malloc(bcq->mslab, sizeof(bcq_msg_t) + len)
+                                              : malloc(sizeof(bcq_msg_t) + len));
+    if (msg == NULL) {
+        int ec = errno;
+        mtx_unlock(&bcq->lock);
+        errno = ec;
+        return -1;
+    }
+    memcpy(msg->data, data, len);
+    msg->len = len;
+    msg->refcnt = bcq->nsubs;
+    msg->lent = false;
+    TAILQ_INSERT_TAIL(&bcq->msgs, msg, entry);
+    bcq->count++;
+
+    bcq_sub_t *sub;
+    TAILQ_FOREACH(sub, &bcq->subs, entry) {
+        if (sub->next == NULL)
+            sub->next = msg;
+    }
+    int nsubs = bcq->nsubs;
+    bool wake = (bcq->nwait > 0);
+    mtx_unlock(&bcq->lock);
+
+    if (wake)
+        cnd_broadcast(&bcq->cond);
+    return nsubs;
+}
+
+/**
+ * @brief   内部函数，加锁并等待订阅者有未读的消息，取出该消息并前移读位置
+ * @param   sub         订阅者
+ *          timeout     接收超时，单位为秒，0表示一直阻塞
+ *          flags       阻塞标志：0表示阻塞，BCQ_NOWAIT表示不阻塞
+ *
+ * @return  成功返回消息，此时已持有锁；失败返回NULL并设置errno，此时未持有锁
+ */
+static bcq_msg_t* bcq_lock_take(bcq_sub_t *sub, double timeout, int flags)
+{
+    bcq_t *bcq = sub->bcq;
+    struct timespec ts;
+    if (timeout > 0)
+        bcq_abstime(&ts, timeout);
+
+    int res = 0;
+    mtx_lock(&bcq->lock);
+    while (res == 0 && sub->next == NULL) {
+        if (flags == BCQ_NOWAIT) {
+            mtx_unlock(&bcq->lock);
+            errno = LIB_ERRNO_QUE_EMPTY;
+            return NULL;
+        }
+        bcq->nwait++;
+        if (timeout > 0) {
+            res = cnd_timedwait(&bcq->cond, &bcq->lock, &ts);
+        } else {
+            res = cnd_wait(&bcq->cond, &bcq->lock);
+        }
+        bcq->nwait--;
+    }
+    if (res != 0) {
+        mtx_unlock(&bcq->lock);
+        errno = (res == thrd_timeout || res == thrd_busy) ? ETIMEDOUT : EINVAL;
+        return NULL;
+    }
+
+    bcq_msg_t *msg = sub->next;
+    sub->next = TAILQ_NEXT(msg, entry);
+    sub->received++;
+    return msg;
+}
+
+/**
+ * @brief   订阅者接收一条消息（拷贝）
+ * @param   sub         订阅者
+ *          buf         接收缓存
+ *          bufsize     接收缓存的大小，消息更长时被截断
+ *          timeout     接收超时，单位为秒，0表示一直阻塞直到收到消息为止
+ *          flags       阻塞标志：0表示阻塞，BCQ_NOWAIT表示不阻塞
+ *
+ * @return  成功返回实际收到的数据长度，失败返回-1并设置errno（超时为ETIMEDOUT，无消息时为LIB_ERRNO_QUE_EMPTY）
+ */
+int bcq_receive(bcq_sub_t *sub, void *buf, size_t bufsize, double timeout, int flags)
+{
+    if (sub == NULL || buf == NULL || bufsize == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    bcq_msg_t *msg = bcq_lock_take(sub, timeout, flags);
+    if (msg == NULL)
+        return -1;
+    size_t cpsize = (bufsize < msg->len) ? bufsize : msg->len;
+    memcpy(buf, msg->data, cpsize);
+    bcq_unref(sub->bcq, msg);
+    mtx_unlock(&sub->bcq->lock);
+    return cpsize;
+}
+
+/**
+ * @brief   订阅者借出一条消息，直接读取共享的消息而不拷贝，用完后通过bcq_release归还
+ * @param   sub         订阅者
+ *          len         输出消息的长度
+ *          timeout     接收超时，单位为秒，0表示一直阻塞直到收到消息为止
+ *          flags       阻塞标志：0表示阻塞，BCQ_NOWAIT表示不阻塞
+ *
+ * @return  成功返回消息数据指针（只读，其他订阅者也在读取），失败返回NULL并设置errno
+ *
+ * @attention   借出的消息在归还之前不会被释放；需要腾出空位时它被移出队列，不会阻塞发布者，
+ *              但仍占用内存，所以应尽快归还
+ */
+void* bcq_receive_borrow(bcq_sub_t *sub, size_t *len, double timeout, int flags)
+{
+    if (sub == NULL || len == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    bcq_msg_t *msg = bcq_lock_take(sub, timeout, flags);
+    if (msg == NULL)
+        return NULL;
+    mtx_unlock(&sub->bcq->lock);
+    *len = msg->len;
+    return msg->data;
+}
+
+/**
+ * @brief   归还bcq_receive_borrow借出的消息
+ * @param   sub     订阅者
+ *          data    bcq_receive_borrow返回的消息数据指针
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ */
+int bcq_release(bcq_sub_t *sub, void *data)
+{
+    if (sub == NULL || data == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    bcq_t *bcq = sub->bcq;
+    mtx_lock(&bcq->lock);
+    bcq_unref(bcq, BCQ_DATA_MSG(data));
+    mtx_unlock(&bcq->lock);
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,100 @@
+/**
+ * @file    bcq.h
+ * @author  ln
+ * @brief   广播队列（发布/订阅），一条消息只保存一份，由所有订阅者共享\n
+ *
+ *          发布的消息带引用计数，初值为发布时的订阅者个数，每个订阅者读完（或归还）后减1，减到0时释放；
+ *          每个订阅者有自己的读位置，只能收到订阅之后发布的消息
+ *
+ *          队列最多保留capacity条消息，队列满时按订阅者的策略处理较慢的订阅者：
+ *          BCQ_DROP的订阅者丢弃最旧的未读消息（计入dropped），BCQ_BLOCK的订阅者使发布者阻塞直到其读取；
+ *          已借出而未归还的消息不会阻塞发布者，需要腾出空位时它被移出队列，归还后才释放内存
+ */
+
+#ifndef __BCAST_QUEUE__
+#define __BCAST_QUEUE__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "sysque.h"
+#include "threads_c11.h"
+#include "err.h"
+#include "mslab.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// 默认最多保留的消息条数
+#define BCQ_CAPACITY_DEF        4096
+
+enum {
+    BCQ_DROP = 0,               ///< 订阅者跟不上时丢弃其最旧的未读消息，发布者不阻塞
+    BCQ_BLOCK                   ///< 订阅者跟不上时发布者阻塞，直到该订阅者读取
+};
+
+/// 广播队列中的消息
+typedef struct __bcq_msg {
+    TAILQ_ENTRY(__bcq_msg)  entry;      ///< 链表元素的表头
+    int                     refcnt;     ///< 尚未读完（或尚未归还）该消息的订阅者个数
+    bool                    lent;       ///< 已移出队列、只剩借出引用（位于borrowed链表）
+    size_t                  len;        ///< 消息的数据长度
+    unsigned char           data[];     ///< 消息的数据区
+} bcq_msg_t;
+
+typedef TAILQ_HEAD(__bcq_msg_head, __bcq_msg) bcq_msg_head_t;
+
+struct __bcq;
+
+/// 订阅者
+typedef struct __bcq_sub {
+    TAILQ_ENTRY(__bcq_sub)  entry;      ///< 链表元素的表头
+    struct __bcq            *bcq;       ///< 所属的广播队列
+    bcq_msg_t               *next;      ///< 下一条要读取的消息，NULL表示已读完，等待新消息
+    int                     policy;     ///< 跟不上时的策略，BCQ_DROP或BCQ_BLOCK
+    uint64_t                received;   ///< 收到的消息条数
+    uint64_t                dropped;    ///< 因跟不上而丢弃的消息条数
+} bcq_sub_t;
+
+typedef TAILQ_HEAD(__bcq_sub_head, __bcq_sub) bcq_sub_head_t;
+
+/// 广播队列
+typedef struct __bcq {
+    mslab_t             *mslab;         ///< 多规格分配器指针，为NULL时采用malloc和free
+
+    bcq_msg_head_t      msgs;           ///< 保留的消息，由旧到新
+    int                 count;          ///< 保留的消息条数
+    int                 capacity;       ///< 最多保留的消息条数
+    bcq_msg_head_t      borrowed;       ///< 为腾出空位而移出队列、但仍被借出的消息，不计入count
+
+    bcq_sub_head_t      subs;           ///< 订阅者
+    int                 nsubs;          ///< 订阅者个数
+
+    mtx_t               lock;           ///< 互斥锁
+    cnd_t               cond;           ///< 条件变量，订阅者在其上等待新消息
+    cnd_t               space;          ///< 条件变量，发布者在其上等待BCQ_BLOCK订阅者读取
+    int                 nwait;          ///< 等待新消息的订阅者个数
+    int                 nwait_pub;      ///< 等待空位的发布者个数
+} bcq_t;
+
+#define BCQ_INIT(b)                     bcq_init(b, 0, NULL)
+
+#define BCQ_NOWAIT                      1
+
+extern int          bcq_init(bcq_t *bcq, int capacity, mslab_t *slab);
+extern void         bcq_destroy(bcq_t *bcq);
+
+extern bcq_sub_t*   bcq_subscribe(bcq_t *bcq, int policy);
+extern void         bcq_unsubscribe(bcq_sub_t *sub);
+
+extern int          bcq_publish(bcq_t *bcq, const void *data, size_t len, double timeout, int flags);
+
+extern int          bcq_receive(bcq_sub_t *sub, void *buf, size_t bufsize, double timeout, int flags);
+extern void*        bcq_receive_borrow(bcq_sub_t *sub, size_t *len, double timeout, int flags);
+extern int          bcq_release(bcq_sub_t *sub, void *data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __BCAST_QUEUE__ */
@@ -160,6 +160,31 @@ char* abin2hex(const void *bin, size_t len)
     return s;
 }
 
+/**
+ * @brief   二进制转换为hex，输出缓存从线性分配器中分配
+ *
+ * @param   arena   线性分配器
+ * @param   bin     输入的二进制数据
+ * @param   len     输入二进制数据的长度
+ *
+ * @return  成功返回hex字符串指针，失败返回NULL并设置errno
+ *
+ * @attention   返回的hex缓存不需要free，随arena_reset一并回收
+ */
+char* abin2hex_arena(arena_t *arena, const void *bin, size_t len)
+{
+    if (arena == NULL || bin == NULL || len == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    char *s = (char*)arena_malloc(arena, (len * 2) + 1);
+    if (s != NULL) {
+        bin2hex(s, bin, len);
+    }
+    return s;
+}
+
 
 /**
  * @brief   hex转换为二进制
@@ -223,6 +248,34 @@ void* ahex2bin(const char *hex, size_t *bin_len)
     return (void *)b;
 }
 
+/**
+ * @brief   hex转换为二进制，输出缓存从线性分配器中分配
+ *
+ * @param   arena   线性分配器
+ * @param   hex     输入的hex字符串
+ * @param   bin_len 输出缓存里已转换的字节数，bin_len可以为NULL
+ *
+ * @return  成功返回二进制数据的指针，失败返回NULL并设置errno
+ *
+ * @attention   hex串必须以0结束; 返回的二进制数据不需要free，随arena_reset一并回收
+ */
+void* ahex2bin_arena(arena_t *arena, const char *hex, size_t *bin_len)
+{
+    if (arena == NULL || hex == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t len = strlen(hex);
+    unsigned char *b = (unsigned char*)arena_malloc(arena, len/2 + 1);
+    if (b != NULL) {
+        size_t ret = hex2bin(b, hex, len/2 + 1);
+        if (bin_len)
+            *bin_len = ret;
+    }
+    return (void *)b;
+}
+
 /**
  * @brief   以字节为单位，反转指定长度的内存块
  *
@@ -8,6 +8,7 @@
 #define __C_STRING_H__
 
 #include <string.h>
+#include "arena.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -29,9 +30,11 @@ char*           strdup(const char *s)
 
 extern int      bin2hex(char *hex, const void *bin, size_t len);
 extern char*    abin2hex(const void *bin, size_t len);
+extern char*    abin2hex_arena(arena_t *arena, const void *bin, size_t len);
 
 extern int      hex2bin(void *bin, const char *hex, size_t len);
 extern void*    ahex2bin(const char *hex, size_t *bin_len);
+extern void*    ahex2bin_arena(arena_t *arena, const char *hex, size_t *bin_len);
 
 extern int      memswap(void *out, const void *in, size_t len, size_t section_size);
 
@@ -5,25 +5,747 @@
  *
  *          内存池空间可以来自外部已分配好的较大buffer，也可以由模块内部自动malloc一块较大内存；\n
  *          内存池大小可以由外部指定，也可以任由模块自动增长（即当内存池为空或耗尽时，
- *          模块自动向系统一次性申请包含N个块的较大内存块）
+ *          模块自动向系统一次性申请包含N个块的较大内存块，N从MPOOL_BLOCK_NUM_ALLOC开始每次翻倍直到上限）
  *          内存池每个小块的大小（即申请与释放的固定块大小）必须外部指定，否则将与malloc等效
  *
- *          内存池从系统malloc到的内存块不会被free，直到内存池管理对象被销毁(mpool_destroy)
+ *          内存池从系统malloc到的内存块不会被free，直到内存池管理对象被销毁(mpool_destroy)，
+ *          或者通过mpool_trim把块已全部空闲的大块归还系统
  *
  *          使用时只需要先初始化mpool_init，之后便可以进行“分配”mpool_malloc与“释放”mpool_free
  */
 
 #include "mpool.h"
 #include "err.h"
+#include "timetick.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// 块的有效数据指针
+#define MPOOL_ELM_DATA(mpool, p)            ((void *)((char *)(p) + (mpool)->hdr_size))
+/// 由有效数据指针得到块指针
+#define MPOOL_DATA_ELM(mpool, mem)          ((mpool_elm_t *)((char *)(mem) - (mpool)->hdr_size))
+
+/// 加锁，单属主模式下不加锁（调试版本检查调用线程是否为属主）
+#define MPOOL_LOCK(mpool) \
+    do { \
+        if ((mpool)->single) \
+            MPOOL_OWNER_CHECK(mpool); \
+        else \
+            mpool_lock(mpool); \
+    } while (0)
+/// 解锁，单属主模式下不需要解锁
+#define MPOOL_UNLOCK(mpool) \
+    do { \
+        if (!(mpool)->single) \
+            mtx_unlock(&(mpool)->lock); \
+    } while (0)
+
+#ifdef DEBUG
+/// 单属主模式下，第一个访问内存池的线程成为属主，此后只允许属主访问
+#define MPOOL_OWNER_CHECK(mpool) \
+    do { \
+        if (!(mpool)->owner_bound) { \
+            (mpool)->owner = thrd_current(); \
+            (mpool)->owner_bound = 1; \
+        } \
+        assert(thrd_equal((mpool)->owner, thrd_current())); \
+    } while (0)
+#else
+#define MPOOL_OWNER_CHECK(mpool)            do {} while (0)
+#endif
+
+/// 累加本线程的计数：只有所属线程写入，mpool_stats并发读取
+#define MPOOL_STAT_ADD(var, n)              __atomic_store_n(&(var), (var) + (n), __ATOMIC_RELAXED)
+
+/// 线程缓存为空或已满时，一次性与共享链表交换的块数
+#define MPOOL_MAG_BATCH(mpool)              (((mpool)->mag_size + 1) / 2)
+
+#define MPOOL_LF_PTR_MASK                   ((((uint64_t)1) << MPOOL_LF_PTR_BITS) - 1)
+/// 从栈顶值中取出块指针
+#define MPOOL_LF_PTR(top)                   ((mpool_elm_t *)(uintptr_t)((top) & MPOOL_LF_PTR_MASK))
+/// 用块指针和上一个栈顶值的计数构造新的栈顶值
+#define MPOOL_LF_PACK(ptr, top) \
+    ((((top) + (((uint64_t)1) << MPOOL_LF_PTR_BITS)) & ~MPOOL_LF_PTR_MASK) | (uint64_t)(uintptr_t)(ptr))
+
+/**
+ * @brief   内部函数，线程退出时由TSS析构调用，把线程的计数并入内存池并释放
+ * @param   arg     线程计数指针
+ * @return  void
+ */
+static void mpool_tstat_release(void *arg)
+{
+    mpool_tstat_t *ts = (mpool_tstat_t *)arg;
+    mpool_t *mpool = ts->mpool;
+
+    mtx_lock(&mpool->lock);
+    mpool->tstat_exit.allocs += ts->allocs;
+    mpool->tstat_exit.frees += ts->frees;
+    mpool->tstat_exit.fails += ts->fails;
+    mpool->tstat_exit.contended += ts->contended;
+    mpool->tstat_exit.wait_ns += ts->wait_ns;
+    TAILQ_REMOVE(&mpool->hdr_tstat, ts, entry);
+    mtx_unlock(&mpool->lock);
+    free(ts);
+}
+
+/**
+ * @brief   内部函数，获取当前线程的计数，不存在时创建
+ * @param   mpool   内存池对象指针
+ * @return  成功返回线程计数指针，失败返回NULL（本次不计数）
+ */
+static mpool_tstat_t* mpool_tstat_get(mpool_t *mpool)
+{
+    mpool_tstat_t *ts = (mpool_tstat_t *)tss_get(mpool->stat_key);
+    if (ts)
+        return ts;
+
+    ts = (mpool_tstat_t *)calloc(1, sizeof(mpool_tstat_t));
+    if (ts == NULL)
+        return NULL;
+    ts->mpool = mpool;
+    if (tss_set(mpool->stat_key, ts) != thrd_success) {
+        free(ts);
+        return NULL;
+    }
+    mtx_lock(&mpool->lock);
+    TAILQ_INSERT_HEAD(&mpool->hdr_tstat, ts, entry);
+    mtx_unlock(&mpool->lock);
+    return ts;
+}
+
+/**
+ * @brief   内部函数，累加当前线程的分配与释放计数
+ * @param   mpool   内存池对象指针
+ *          allocs  分配成功的块数
+ *          frees   释放的块数
+ *          fail    是否有分配因内存池耗尽而失败
+ * @return  void，不改变errno
+ */
+static void mpool_stat_count(mpool_t *mpool, size_t allocs, size_t frees, int fail)
+{
+    int ec = errno;
+    mpool_tstat_t *ts = mpool_tstat_get(mpool);
+    if (ts) {
+        if (allocs)
+            MPOOL_STAT_ADD(ts->allocs, allocs);
+        if (frees)
+            MPOOL_STAT_ADD(ts->frees, frees);
+        if (fail)
+            MPOOL_STAT_ADD(ts->fails, 1);
+    }
+    errno = ec;
+}
+
+/**
+ * @brief   内部函数，对内存池加锁；开启计数时，锁被占用则记录一次争用及等待时间
+ * @param   mpool   内存池对象指针
+ * @return  void
+ */
+static void mpool_lock(mpool_t *mpool)
+{
+    if (!mpool->stats) {
+        mtx_lock(&mpool->lock);
+        return;
+    }
+    if (mtx_trylock(&mpool->lock) == thrd_success)
+        return;
+
+    double t0 = monotime();
+    mtx_lock(&mpool->lock);
+    uint64_t ns = (uint64_t)((monotime() - t0) * 1e9);
+    mpool_tstat_t *ts = mpool_tstat_get(mpool);     // the lock is recursive
+    if (ts) {
+        MPOOL_STAT_ADD(ts->contended, 1);
+        MPOOL_STAT_ADD(ts->wait_ns, ns);
+    }
+}
+
+/**
+ * @brief   内部函数，获取当前线程所在的NUMA节点
+ * @return  节点号（对MPOOL_NUMA_NODE_MAX取模），无法获取时返回0
+ */
+static int mpool_numa_node(void)
+{
+#if defined(__linux__) && defined(SYS_getcpu)
+    unsigned cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+        return (int)(node % MPOOL_NUMA_NODE_MAX);
+#endif
+    return 0;
+}
+
+/**
+ * @brief   内部函数，通过mmap申请大块
+ * @param   mpool   内存池对象指针
+ *          size    大块大小，使用大页时会被向上对齐到大页大小
+ *
+ * @return  成功返回大块指针，失败返回NULL
+ *
+ * @note    大页模式下先尝试MAP_HUGETLB（需要系统预留大页），失败后退回普通页并通过madvise建议内核使用透明大页
+ */
+static mpool_chunk_t* mpool_chunk_mmap(mpool_t *mpool, size_t *size)
+{
+    void *p = MAP_FAILED;
+    int huge = mpool->hugepage && *size >= MPOOL_HUGEPAGE_SIZE;
+
+    if (huge) {
+        *size = MPOOL_ALIGN_UP(*size, MPOOL_HUGEPAGE_SIZE);
+#ifdef MAP_HUGETLB
+        p = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    }
+    if (p == MAP_FAILED) {
+        p = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return NULL;
+#ifdef MADV_HUGEPAGE
+        if (huge)
+            madvise(p, *size, MADV_HUGEPAGE);
+#endif
+    }
+    return (mpool_chunk_t *)p;
+}
+
+/**
+ * @brief   内部函数，把大块归还系统
+ * @param   chunk   大块指针
+ * @return  void
+ */
+static void mpool_chunk_free(mpool_chunk_t *chunk)
+{
+    if (chunk->mmapped)
+        munmap(chunk, chunk->size);
+    else
+        free(chunk);
+}
+
+/**
+ * @brief   内部函数，查找块所在的大块
+ * @param   mpool   内存池对象指针
+ *          p       块指针
+ *
+ * @return  找到返回大块指针，否则（例如外部模式的块）返回NULL
+ * @attention 调用者需持有内存池的锁
+ */
+static mpool_chunk_t* mpool_chunk_find(mpool_t *mpool, const void *p)
+{
+    size_t lo = 0, hi = mpool->chunk_cnt;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        mpool_chunk_t *chunk = mpool->chunk_idx[mid];
+        if ((const char *)p < chunk->data)
+            hi = mid;
+        else if ((const char *)p >= (char *)chunk + chunk->size)
+            lo = mid + 1;
+        else
+            return chunk;
+    }
+    return NULL;
+}
+
+/**
+ * @brief   内部函数，把大块按地址顺序插入大块索引
+ * @param   mpool   内存池对象指针
+ *          chunk   大块指针
+ *
+ * @return  成功返回0，失败返回-1
+ * @attention 调用者需持有内存池的锁
+ */
+static int mpool_chunk_index_add(mpool_t *mpool, mpool_chunk_t *chunk)
+{
+    if (mpool->chunk_cnt == mpool->chunk_cap) {
+        size_t cap = mpool->chunk_cap ? mpool->chunk_cap * 2 : 8;
+        mpool_chunk_t **idx = (mpool_chunk_t **)realloc(mpool->chunk_idx, cap * sizeof(mpool_chunk_t *));
+        if (idx == NULL)
+            return -1;
+        mpool->chunk_idx = idx;
+        mpool->chunk_cap = cap;
+    }
+
+    size_t i = mpool->chunk_cnt;
+    while (i > 0 && mpool->chunk_idx[i-1] > chunk) {
+        mpool->chunk_idx[i] = mpool->chunk_idx[i-1];
+        i--;
+    }
+    mpool->chunk_idx[i] = chunk;
+    mpool->chunk_cnt++;
+    return 0;
+}
+
+/**
+ * @brief   内部函数，把大块从大块索引中删除
+ * @param   mpool   内存池对象指针
+ *          chunk   大块指针
+ * @return  void
+ * @attention 调用者需持有内存池的锁
+ */
+static void mpool_chunk_index_del(mpool_t *mpool, mpool_chunk_t *chunk)
+{
+    size_t i;
+    for (i=0; i<mpool->chunk_cnt && mpool->chunk_idx[i] != chunk; i++)
+        ;
+    if (i == mpool->chunk_cnt)
+        return;
+    memmove(&mpool->chunk_idx[i], &mpool->chunk_idx[i+1], (mpool->chunk_cnt - i - 1) * sizeof(mpool_chunk_t *));
+    mpool->chunk_cnt--;
+}
+
+/**
+ * @brief   内部函数，向系统申请一个至少可以容纳n个块的大块，并挂到大块链表上
+ * @param   mpool   内存池对象指针
+ *          n       块数
+ *          node    NUMA模式下大块所要绑定的节点
+ *
+ * @return  成功返回大块指针（chunk->num为实际可容纳的块数），失败返回NULL
+ * @attention 调用者需持有内存池的锁
+ *
+ * @note    大块同时按地址插入大块索引；
+ *          NUMA模式下大块由mmap申请并优先绑定到node节点，页面在分割时由当前线程首次写入，
+ *          所以即使绑定失败，按Linux的首次访问策略页面仍然位于当前节点；
+ *          大页模式下，不小于大页大小的大块也由mmap申请
+ */
+static mpool_chunk_t* mpool_chunk_alloc(mpool_t *mpool, size_t n, int node)
+{
+    mpool_chunk_t *chunk;
+    size_t size = sizeof(mpool_chunk_t) + mpool->align + n * mpool->block_size;
+
+    if (mpool->numa || (mpool->hugepage && size >= MPOOL_HUGEPAGE_SIZE)) {
+        if ((chunk = mpool_chunk_mmap(mpool, &size)) == NULL)
+            return NULL;
+#if defined(__linux__) && defined(SYS_mbind)
+        if (mpool->numa) {
+            unsigned long mask = 1UL << node;
+            syscall(SYS_mbind, chunk, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+        }
+#endif
+        chunk->mmapped = 1;
+    } else {
+        if ((chunk = (mpool_chunk_t *)malloc(size)) == NULL)
+            return NULL;
+        chunk->mmapped = 0;
+    }
+    chunk->size = size;
+    chunk->idle = 0;
+    chunk->nfree = 0;
+    chunk->node = node;
+    chunk->num = (size - sizeof(mpool_chunk_t) - mpool->align) / mpool->block_size;
+    if (mpool_chunk_index_add(mpool, chunk) != 0) {
+        mpool_chunk_free(chunk);
+        return NULL;
+    }
+    TAILQ_INSERT_HEAD(&mpool->hdr_buf, chunk, entry);
+    mpool->st_total += chunk->num;
+    mpool->st_reserved += chunk->size;
+    return chunk;
+}
+
+/**
+ * @brief   内部函数，把从buf开始的n个块挂到空闲链表上
+ * @param   mpool   内存池对象指针
+ *          hdr     空闲链表
+ *          buf     块区的起始地址，函数内部会按mpool->align对齐
+ *          n       块数
+ *
+ * @return  void
+ * @note    每个块的有效数据按mpool->align对齐；远程释放模式下块表头紧挨有效数据，块表头之前是对齐填充
+ */
+static void mpool_carve(mpool_t *mpool, mpool_head_t *hdr, char *buf, size_t n)
+{
+    buf = (char *)MPOOL_ALIGN_UP((uintptr_t)buf, mpool->align);
+    for (size_t i=0; i<n; i++) {
+        TAILQ_INSERT_HEAD(  hdr,
+                            (mpool_elm_t *)(buf + i*mpool->block_size + mpool->block_off),
+                            entry   );
+    }
+}
+
+/**
+ * @brief   内部函数，自增长模式下向系统申请一个大块并分割为小块
+ * @param   mpool   内存池对象指针
+ *          hdr     新的块所挂入的空闲链表
+ *          node    NUMA模式下大块所要绑定的节点
+ *
+ * @return  成功返回0，失败返回-1
+ * @attention 调用者需持有内存池的锁
+ *
+ * @note    第一次增长MPOOL_BLOCK_NUM_ALLOC个块，此后每次翻倍，直到mpool->grow_max
+ */
+static int mpool_grow(mpool_t *mpool, mpool_head_t *hdr, int node)
+{
+    mpool_chunk_t *chunk = mpool_chunk_alloc(mpool, mpool->grow_num, node);
+    if (chunk == NULL)
+        return -1;
+    mpool_carve(mpool, hdr, chunk->data, chunk->num);
+    mpool->st_grows++;
+
+    mpool->grow_num *= 2;
+    if (mpool->grow_num > mpool->grow_max)
+        mpool->grow_num = mpool->grow_max;
+    return 0;
+}
+
+/**
+ * @brief   内部函数，无锁模式下弹出空闲栈顶的块
+ * @param   mpool   内存池对象指针
+ * @return  成功返回块指针，栈空返回NULL
+ *
+ * @note    块被其他线程抢先弹出时，读到的next可能已失效，但此时栈顶计数已改变，CAS必然失败；
+ *          块所在的大块直到内存池销毁才会释放，所以读取总是合法的
+ */
+static mpool_elm_t* mpool_lf_pop(mpool_t *mpool)
+{
+    uint64_t top = __atomic_load_n(&mpool->lf_top, __ATOMIC_ACQUIRE);
+    for (;;) {
+        mpool_elm_t *p = MPOOL_LF_PTR(top);
+        if (p == NULL)
+            return NULL;
+        mpool_elm_t *next = __atomic_load_n(&p->entry.tqe_next, __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&mpool->lf_top, &top, MPOOL_LF_PACK(next, top),
+                                        1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+            return p;
+    }
+}
+
+/**
+ * @brief   内部函数，无锁模式下把一串块(first...last，已通过entry.tqe_next相连)压入空闲栈
+ * @param   mpool   内存池对象指针
+ *          first   块串的第一个块
+ *          last    块串的最后一个块
+ * @return  void
+ */
+static void mpool_lf_push(mpool_t *mpool, mpool_elm_t *first, mpool_elm_t *last)
+{
+    uint64_t top = __atomic_load_n(&mpool->lf_top, __ATOMIC_RELAXED);
+    do {
+        __atomic_store_n(&last->entry.tqe_next, MPOOL_LF_PTR(top), __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&mpool->lf_top, &top, MPOOL_LF_PACK(first, top),
+                                          1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief   内部函数，无锁模式下把空闲链表中的所有块移入空闲栈
+ * @param   mpool   内存池对象指针
+ * @return  void
+ * @attention 空闲链表中的块本身已经通过entry.tqe_next相连
+ */
+static void mpool_lf_push_free(mpool_t *mpool)
+{
+    if (!TAILQ_EMPTY(&mpool->hdr_free)) {
+        mpool_lf_push(mpool, TAILQ_FIRST(&mpool->hdr_free),
+                             TAILQ_LAST(&mpool->hdr_free, __mpool_head));
+        TAILQ_INIT(&mpool->hdr_free);
+    }
+}
+
+/**
+ * @brief   内部函数，用户同时持有的块数达到live时更新高水位
+ * @param   mpool   内存池对象指针
+ *          live    当前用户持有的块数
+ * @return  void
+ *
+ * @note    无锁模式下不持有锁，所以通过CAS更新
+ */
+static void mpool_hwm_update(mpool_t *mpool, size_t live)
+{
+    size_t hwm = __atomic_load_n(&mpool->st_hwm, __ATOMIC_RELAXED);
+    while (live > hwm &&
+           !__atomic_compare_exchange_n(&mpool->st_hwm, &hwm, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/**
+ * @brief   内部函数，用户持有的块数：不在共享空闲链表中的块数减去各线程缓存中的块数
+ * @param   mpool   内存池对象指针
+ * @return  用户持有的块数
+ * @attention 调用者需持有内存池的锁（线程缓存链表由锁保护）
+ *
+ * @note    各线程缓存的块数由其所属线程不加锁地修改，这里读到的是近似值
+ */
+static size_t mpool_live(mpool_t *mpool)
+{
+    size_t used = __atomic_load_n(&mpool->st_used, __ATOMIC_RELAXED);
+    size_t held = 0;
+    mpool_mag_t *mag;
+    TAILQ_FOREACH(mag, &mpool->hdr_mag, entry) {
+        held += __atomic_load_n(&mag->count, __ATOMIC_RELAXED);
+    }
+    return (used > held) ? used - held : 0;
+}
+
+/**
+ * @brief   内部函数，无锁模式下分配一个块，空闲栈为空时（自增长模式）加锁增长
+ * @param   mpool   内存池对象指针
+ * @return  成功返回块指针，失败返回NULL并设置errno
+ *
+ * @note    锁只用于串行化增长，分配与释放本身不加锁
+ */
+static mpool_elm_t* mpool_lf_get_block(mpool_t *mpool)
+{
+    mpool_elm_t *p = mpool_lf_pop(mpool);
+    if (p == NULL && mpool->mode == MPOOL_MODE_DGROWN) {
+        mpool_lock(mpool);
+        if ((p = mpool_lf_pop(mpool)) == NULL && mpool_grow(mpool, &mpool->hdr_free, 0) == 0) {
+            p = TAILQ_LAST(&mpool->hdr_free, __mpool_head);
+            TAILQ_REMOVE(&mpool->hdr_free, p, entry);
+            mpool_lf_push_free(mpool);
+        }
+        mtx_unlock(&mpool->lock);
+    }
+    if (p == NULL)
+        errno = LIB_ERRNO_SHORT_MPOOL;
+    else
+        mpool_hwm_update(mpool, __atomic_add_fetch(&mpool->st_used, 1, __ATOMIC_RELAXED));
+    return p;
+}
+
+/**
+ * @brief   内部函数，从空闲链表取出一个块，自增长模式下空闲块耗尽时自动增长
+ * @param   mpool   内存池对象指针
+ * @return  成功返回块指针，失败返回NULL并设置errno
+ * @attention 调用者需持有内存池的锁
+ *
+ * @note    NUMA模式下优先使用当前线程所在节点的空闲块，本节点无法满足时才使用其他节点的空闲块
+ */
+static mpool_elm_t* mpool_get_block(mpool_t *mpool)
+{
+    int node = 0;
+    mpool_head_t *hdr = &mpool->hdr_free;
+    if (mpool->numa) {
+        node = mpool_numa_node();
+        hdr = &mpool->hdr_node[node];
+    }
+
+    if (TAILQ_EMPTY(hdr)) {
+        if (mpool->mode != MPOOL_MODE_DGROWN || mpool_grow(mpool, hdr, node) != 0) {
+            if (!mpool->numa) {
+                errno = LIB_ERRNO_SHORT_MPOOL;
+                return NULL;
+            }
+            for (node = 0; node < MPOOL_NUMA_NODE_MAX; node++) {
+                if (!TAILQ_EMPTY(&mpool->hdr_node[node]))
+                    break;
+            }
+            if (node == MPOOL_NUMA_NODE_MAX) {
+                errno = LIB_ERRNO_SHORT_MPOOL;
+                return NULL;
+            }
+            hdr = &mpool->hdr_node[node];
+        }
+    }
+    mpool_elm_t *p = TAILQ_LAST(hdr, __mpool_head);
+    TAILQ_REMOVE(hdr, p, entry);
+    if (mpool->remote)
+        p->mag = NULL;
+    mpool->st_used++;
+    if (mpool->mag_size == 0 && mpool->st_used > mpool->st_hwm)   // sampled by mpool_mag_refill otherwise
+        mpool->st_hwm = mpool->st_used;
+    return p;
+}
+
+/**
+ * @brief   内部函数，将块放回空闲链表
+ * @param   mpool   内存池对象指针
+ *          p       块指针
+ * @return  void
+ * @attention 调用者需持有内存池的锁
+ *
+ * @note    NUMA模式下块放回所在大块的节点，外部模式的块不属于任何大块，放回节点0
+ */
+static void mpool_put_block(mpool_t *mpool, mpool_elm_t *p)
+{
+    mpool_head_t *hdr = &mpool->hdr_free;
+    if (mpool->numa) {
+        mpool_chunk_t *chunk = mpool_chunk_find(mpool, p);
+        hdr = &mpool->hdr_node[chunk ? chunk->node : 0];
+    }
+    TAILQ_INSERT_HEAD(hdr, p, entry);
+    mpool->st_used--;
+}
+
+/**
+ * @brief   内部函数，远程释放：把块放入分配该块的线程缓存的收件箱
+ * @param   mag     分配该块的线程缓存
+ *          p       块指针
+ * @return  void
+ *
+ * @note    收件箱是多生产者单消费者的无锁栈，消费者总是一次性取走整个栈，所以不存在ABA问题
+ */
+static void mpool_mag_remote_push(mpool_mag_t *mag, mpool_elm_t *p)
+{
+    mpool_elm_t *head = __atomic_load_n(&mag->inbox, __ATOMIC_RELAXED);
+    do {
+        p->rnext = head;
+    } while (!__atomic_compare_exchange_n(&mag->inbox, &head, p,
+                                          1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief   内部函数，把收件箱中的块全部归还共享链表
+ * @param   mpool   内存池对象指针
+ *          mag     线程缓存
+ * @return  void
+ * @attention 调用者需持有内存池的锁
+ */
+static void mpool_mag_drain(mpool_t *mpool, mpool_mag_t *mag)
+{
+    mpool_elm_t *p = __atomic_exchange_n(&mag->inbox, NULL, __ATOMIC_ACQUIRE);
+    while (p) {
+        mpool_elm_t *next = p->rnext;
+        mpool_put_block(mpool, p);
+        p = next;
+    }
+}
+
+/**
+ * @brief   内部函数，收回收件箱中的块：先放入线程缓存，缓存放不下的再加锁一次归还共享链表
+ * @param   mpool   内存池对象指针
+ *          mag     当前线程的缓存
+ * @return  void
+ */
+static void mpool_mag_reclaim(mpool_t *mpool, mpool_mag_t *mag)
+{
+    if (__atomic_load_n(&mag->inbox, __ATOMIC_RELAXED) == NULL)
+        return;
+
+    mpool_elm_t *p = __atomic_exchange_n(&mag->inbox, NULL, __ATOMIC_ACQUIRE);
+    size_t count = mag->count;
+    while (p && count < mpool->mag_size) {
+        mag->blocks[count++] = p;
+        p = p->rnext;
+    }
+    __atomic_store_n(&mag->count, count, __ATOMIC_RELAXED);    // read by mpool_live
+    if (p) {
+        mpool_lock(mpool);
+        while (p) {
+            mpool_elm_t *next = p->rnext;
+            mpool_put_block(mpool, p);
+            p = next;
+        }
+        mtx_unlock(&mpool->lock);
+    }
+}
+
+/**
+ * @brief   内部函数，线程退出时由TSS析构调用，把线程缓存中的块归还内存池并释放缓存
+ * @param   arg     线程缓存指针
+ * @return  void
+ *
+ * @note    远程释放模式下，其他线程仍可能持有本缓存分配的块并向收件箱释放，
+ *          所以缓存不会被释放，而是标记为dead，等待被新线程复用或在内存池销毁时释放
+ */
+static void mpool_mag_release(void *arg)
+{
+    mpool_mag_t *mag = (mpool_mag_t *)arg;
+    mpool_t *mpool = mag->mpool;
+
+    mtx_lock(&mpool->lock);
+    while (mag->count > 0) {
+        mpool_put_block(mpool, mag->blocks[--mag->count]);
+    }
+    if (mpool->remote) {
+        mpool_mag_drain(mpool, mag);
+        mag->dead = 1;
+        mtx_unlock(&mpool->lock);
+        return;
+    }
+    TAILQ_REMOVE(&mpool->hdr_mag, mag, entry);
+    mtx_unlock(&mpool->lock);
+    free(mag);
+}
+
+/**
+ * @brief   内部函数，获取当前线程的缓存，不存在时创建（远程释放模式下优先复用已退出线程的缓存）
+ * @param   mpool   内存池对象指针
+ * @return  成功返回线程缓存指针，失败返回NULL（调用者应退回到加锁路径）
+ */
+static mpool_mag_t* mpool_mag_get(mpool_t *mpool)
+{
+    mpool_mag_t *mag = (mpool_mag_t *)tss_get(mpool->mag_key);
+    if (mag)
+        return mag;
+
+    mtx_lock(&mpool->lock);
+    if (mpool->remote) {
+        TAILQ_FOREACH(mag, &mpool->hdr_mag, entry) {
+            if (mag->dead)
+                break;
+        }
+    }
+    if (mag == NULL) {
+        mag = (mpool_mag_t *)malloc(sizeof(mpool_mag_t) + mpool->mag_size * sizeof(mpool_elm_t *));
+        if (mag == NULL) {
+            mtx_unlock(&mpool->lock);
+            return NULL;
+        }
+        mag->mpool = mpool;
+        mag->inbox = NULL;
+        mag->count = 0;
+        TAILQ_INSERT_HEAD(&mpool->hdr_mag, mag, entry);
+    }
+    if (tss_set(mpool->mag_key, mag) != thrd_success) {
+        mag->dead = 1;      // stays in the list until reused or destroyed
+        mag = NULL;
+    } else {
+        mag->dead = 0;
+    }
+    mtx_unlock(&mpool->lock);
+    return mag;
+}
+
+/**
+ * @brief   内部函数，加锁一次，从共享链表批量取块填充线程缓存
+ * @param   mpool   内存池对象指针
+ *          mag     线程缓存
+ * @return  void，缓存仍为空时errno已被设置
+ */
+static void mpool_mag_refill(mpool_t *mpool, mpool_mag_t *mag)
+{
+    mpool_elm_t *p;
+    size_t batch = MPOOL_MAG_BATCH(mpool);
 
-#ifdef __cplusplus
-extern "C" {
-#endif
+    mpool_lock(mpool);
+    if (mpool->remote) {
+        mpool_mag_t *dead;
+        TAILQ_FOREACH(dead, &mpool->hdr_mag, entry) {
+            if (dead->dead)
+                mpool_mag_drain(mpool, dead);
+        }
+    }
+    mpool_hwm_update(mpool, mpool_live(mpool));
+    while (mag->count < batch && (p = mpool_get_block(mpool)) != NULL) {
+        mag->blocks[mag->count++] = p;
+    }
+    mtx_unlock(&mpool->lock);
+}
+
+/**
+ * @brief   内部函数，加锁一次，把线程缓存中的一批块归还共享链表
+ * @param   mpool   内存池对象指针
+ *          mag     线程缓存
+ * @return  void
+ */
+static void mpool_mag_flush(mpool_t *mpool, mpool_mag_t *mag)
+{
+    size_t batch = MPOOL_MAG_BATCH(mpool);
 
-#define OFFSET_OF(TYPE, MEMBER)             ((size_t)&((TYPE *)0)->MEMBER)
-#define CONTAINER_OF(ptr, type, member)     ((type *)((char *)(ptr) - OFFSET_OF(type,member)))
+    mpool_lock(mpool);
+    while (batch-- > 0 && mag->count > 0) {
+        mpool_put_block(mpool, mag->blocks[--mag->count]);
+    }
+    mtx_unlock(&mpool->lock);
+}
 
 /**
  * @brief   初始化内存池
@@ -51,66 +773,227 @@ extern "C" {
  * MPOOL_MODE_ESTATIC: n != 0, data_size != 0, ebuf != NULL
  * 外部模式：由外部参数传入一个内存块，内存块大小被认定为 n*data_size
  *
- * @attention   由于数据大小 data_size 总是被强制与sizeof(int)对齐，\n
- *              所以在外部模式下，实际可用的块数目 m 可能少于请求的数目 n，\n
- *              例如 mpool_init(mpl,3,1,ebuf)会返回-1，因为 (1*3)/4=0，即无块可用
+ * @attention   由于数据大小 data_size 总是被强制与sizeof(int)对齐，且空闲块需要在数据区中存放链表指针，\n
+ *              所以在外部模式下，实际可用的块数目 m = (n*data_size) / MPOOL_BLOCK_SIZE(data_size)，可能少于请求的数目 n，\n
+ *              例如 mpool_init(mpl,4,1,ebuf)会返回-1，因为 (1*4)/16=0，即无块可用
  */
 int mpool_init(mpool_t *mpool, size_t data_size, size_t n, void *ebuf)
+{
+    return mpool_init_ex(mpool, data_size, n, ebuf, NULL);
+}
+
+/**
+ * @brief   初始化内存池属性为默认值
+ * @param   attr    内存池属性
+ * @return  void
+ */
+void mpool_attr_init(mpool_attr_t *attr)
+{
+    if (attr) {
+        attr->mag_size = 0;
+        attr->flags = 0;
+        attr->align = 0;
+        attr->grow_max = 0;
+    }
+}
+
+/**
+ * @brief   内部函数，mpool_init_ex失败时释放已创建的资源（大块、索引、NUMA链表、TSS键与互斥锁）
+ * @param   mpool   内存池对象
+ * @return  void，errno保持不变
+ */
+static void mpool_init_undo(mpool_t *mpool)
+{
+    int ec = errno;
+    while (!TAILQ_EMPTY(&mpool->hdr_buf)) {
+        mpool_chunk_t *chunk = TAILQ_FIRST(&mpool->hdr_buf);
+        TAILQ_REMOVE(&mpool->hdr_buf, chunk, entry);
+        mpool_chunk_free(chunk);
+    }
+    free(mpool->chunk_idx);
+    mpool->chunk_idx = NULL;
+    free(mpool->hdr_node);
+    mpool->hdr_node = NULL;
+    if (mpool->stats) {
+        tss_delete(mpool->stat_key);
+        mpool->stats = 0;
+    }
+    mtx_destroy(&mpool->lock);
+    mpool->mode = MPOOL_MODE_DESTROYED;
+    errno = ec;
+}
+
+/**
+ * @brief   按指定属性初始化内存池
+ *
+ * @param   mpool       内存池对象
+ *          data_size   用户数据大小
+ *          n           最大使用的块数
+ *          ebuf        外部buffer
+ *          attr        内存池属性，NULL表示使用默认属性（等效于mpool_init）
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ *
+ * @note    attr->mag_size不为0时，每个线程第一次分配或释放时会创建一个可容纳mag_size个块的缓存，
+ *          此后该线程的分配与释放优先在缓存中完成而无需加锁；MPOOL_MODE_MALLOC模式忽略该属性
+ *
+ *          attr->flags含MPOOL_ATTR_LOCKFREE时，空闲块构成无锁栈，不能与线程缓存同时使用；
+ *          MPOOL_MODE_MALLOC模式忽略该标志
+ *
+ *          attr->align不为0时，每块的有效数据按align对齐，且块与块之间不共享align大小的区间；
+ *          取MPOOL_ALIGN_CACHELINE可以避免分配给不同线程的相邻块发生伪共享
+ *
+ *          attr->flags含MPOOL_ATTR_NUMA时，每个NUMA节点各有一张空闲链表，线程优先分配本节点的块，
+ *          自增长时大块从分配线程所在的节点申请；不能与无锁模式同时使用
+ *
+ *          自增长模式下，第一次增长MPOOL_BLOCK_NUM_ALLOC个块，此后每次翻倍，直到attr->grow_max个块；
+ *          attr->flags含MPOOL_ATTR_HUGEPAGE时，不小于MPOOL_HUGEPAGE_SIZE的大块使用大页
+ *
+ *          attr->flags含MPOOL_ATTR_SINGLE时，内存池只允许一个线程（属主）使用，分配与释放都不加锁；
+ *          调试版本(DEBUG)中第一个分配或释放的线程成为属主，其他线程访问时断言失败；
+ *          不能与线程缓存、无锁模式同时使用，mpool_trim也必须由属主调用
+ *
+ *          attr->flags含MPOOL_ATTR_REMOTE_FREE时（需要attr->mag_size不为0），线程释放由其他线程缓存分配的块时，
+ *          块被无锁地放入分配线程的收件箱，分配线程在缓存耗尽时批量收回，适用于生产者分配、消费者释放的场景
+ *
+ *          attr->flags含MPOOL_ATTR_STATS时，开启每线程计数，见mpool_stats
+ */
+int mpool_init_ex(mpool_t *mpool, size_t data_size, size_t n, void *ebuf, const mpool_attr_t *attr)
 {
     if (mpool == NULL) {
         errno = EINVAL;
         return -1;
     }
 
+    mpool_attr_t def_attr;
+    if (attr == NULL) {
+        mpool_attr_init(&def_attr);
+        attr = &def_attr;
+    }
+    size_t align = attr->align ? attr->align : MPOOL_ALIGN_DEF;
+    if (attr->mag_size > MPOOL_MAG_SIZE_MAX ||
+        (attr->mag_size == 0 && (attr->flags & MPOOL_ATTR_REMOTE_FREE)) ||
+        (attr->mag_size > 0 && (attr->flags & (MPOOL_ATTR_LOCKFREE | MPOOL_ATTR_SINGLE))) ||
+        ((attr->flags & MPOOL_ATTR_LOCKFREE) && (attr->flags & MPOOL_ATTR_SINGLE)) ||
+        ((attr->flags & MPOOL_ATTR_LOCKFREE) && (attr->flags & MPOOL_ATTR_NUMA)) ||
+        (align & (align - 1)) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
     if (mtx_init(&mpool->lock, mtx_plain | mtx_recursive) == thrd_error)
         return -1;
     mpool->sbuf = NULL;
+    mpool->mag_size = 0;
+    mpool->remote = 0;
+    TAILQ_INIT(&mpool->hdr_mag);
+    mpool->lockfree = 0;
+    mpool->lf_top = 0;
+    mpool->numa = 0;
+    mpool->hdr_node = NULL;
+    mpool->single = (attr->flags & MPOOL_ATTR_SINGLE) ? 1 : 0;
+    mpool->owner_bound = 0;
+    TAILQ_INIT(&mpool->hdr_free);
+    TAILQ_INIT(&mpool->hdr_buf);
+    mpool->chunk_idx = NULL;
+    mpool->chunk_cnt = 0;
+    mpool->chunk_cap = 0;
+    mpool->hdr_size = 0;
+    mpool->st_total = 0;
+    mpool->st_used = 0;
+    mpool->st_hwm = 0;
+    mpool->st_grows = 0;
+    mpool->st_reserved = 0;
+    mpool->stats = 0;
+    TAILQ_INIT(&mpool->hdr_tstat);
+    memset(&mpool->tstat_exit, 0, sizeof(mpool_tstat_t));
+    if (attr->flags & MPOOL_ATTR_STATS) {
+        if (tss_create(&mpool->stat_key, mpool_tstat_release) != thrd_success) {
+            errno = LIB_ERRNO_RES_LIMIT;    // PTHREAD_KEYS_MAX reached
+            mpool_init_undo(mpool);
+            return -1;
+        }
+        mpool->stats = 1;
+    }
 
     if (data_size == 0) {
         mpool->mode = MPOOL_MODE_MALLOC;
+        mpool->data_size = 0;
+        return 0;
+    }
+
+    size_t ebuf_size = data_size * n;
+    data_size = MPOOL_ALIGN_SIZE(data_size);
+    mpool->data_size = data_size;
+    mpool->align = align;
+    if (attr->flags & MPOOL_ATTR_REMOTE_FREE) {
+        mpool->hdr_size = sizeof(mpool_elm_t);
+        mpool->block_off = MPOOL_ALIGN_UP(sizeof(mpool_elm_t), align) - sizeof(mpool_elm_t);
+        mpool->block_size = MPOOL_ALIGN_UP(sizeof(mpool_elm_t), align) + MPOOL_ALIGN_UP(data_size, align);
     } else {
-        size_t ebuf_size = data_size * n;
-        data_size = MPOOL_ALIGN_SIZE(data_size);
+        mpool->block_off = 0;
+        mpool->block_size = MPOOL_ALIGN_UP(MPOOL_BLOCK_SIZE(data_size), align);
+    }
+    mpool->hugepage = (attr->flags & MPOOL_ATTR_HUGEPAGE) ? 1 : 0;
+    mpool->grow_max = attr->grow_max;
+    if (mpool->grow_max == 0) {
+        mpool->grow_max = MPOOL_GROW_SIZE_MAX / mpool->block_size;
+        if (mpool->grow_max < MPOOL_BLOCK_NUM_ALLOC)
+            mpool->grow_max = MPOOL_BLOCK_NUM_ALLOC;
+    }
+    mpool->grow_num = (mpool->grow_max < MPOOL_BLOCK_NUM_ALLOC) ? mpool->grow_max : MPOOL_BLOCK_NUM_ALLOC;
 
-        if (n == 0) {
-            mpool->mode = MPOOL_MODE_DGROWN;
-        } else {
-            if (ebuf) {
-                mpool->mode = MPOOL_MODE_ESTATIC;
-                mpool->sbuf = ebuf;
-                n = ebuf_size / data_size;
-                if (n == 0) {
-                    errno = EINVAL;
-                    return -1;
-                }
-            } else {
-                mpool->mode = MPOOL_MODE_ISTATIC;
-            }
+    if (attr->flags & MPOOL_ATTR_NUMA) {
+        mpool->hdr_node = (mpool_head_t *)malloc(MPOOL_NUMA_NODE_MAX * sizeof(mpool_head_t));
+        if (mpool->hdr_node == NULL) {
+            mpool_init_undo(mpool);
+            return -1;
         }
+        for (int i=0; i<MPOOL_NUMA_NODE_MAX; i++) {
+            TAILQ_INIT(&mpool->hdr_node[i]);
+        }
+        mpool->numa = 1;
     }
-    mpool->data_size = data_size;
+    int node = mpool_numa_node();
+    mpool_head_t *hdr = mpool->numa ? &mpool->hdr_node[node] : &mpool->hdr_free;
 
-    TAILQ_INIT(&mpool->hdr_free);
-    TAILQ_INIT(&mpool->hdr_used);
-    TAILQ_INIT(&mpool->hdr_buf);
-    char *p;
-    if (ebuf == NULL && n*data_size > 0) {      // MPOOL_MODE_ISTATIC
-        if ((p = (char *)malloc(MPOOL_BLOCK_SIZE(n*MPOOL_BLOCK_SIZE(data_size)))) == NULL)
+    if (n == 0) {
+        mpool->mode = MPOOL_MODE_DGROWN;
+    } else if (ebuf) {
+        hdr = mpool->numa ? &mpool->hdr_node[0] : &mpool->hdr_free;    // see mpool_put_block
+        mpool->mode = MPOOL_MODE_ESTATIC;
+        mpool->sbuf = ebuf;
+        size_t pad = MPOOL_ALIGN_UP((uintptr_t)ebuf, align) - (uintptr_t)ebuf;
+        n = (ebuf_size > pad) ? (ebuf_size - pad) / mpool->block_size : 0;
+        if (n == 0) {
+            errno = EINVAL;
+            mpool_init_undo(mpool);
             return -1;
-        else
-            TAILQ_INSERT_HEAD(&mpool->hdr_buf, (mpool_elm_t *)p, entry);
+        }
+        mpool_carve(mpool, hdr, ebuf, n);
+        mpool->st_total = n;
+    } else {
+        mpool->mode = MPOOL_MODE_ISTATIC;
+        mpool_chunk_t *chunk = mpool_chunk_alloc(mpool, n, node);
+        if (chunk == NULL) {
+            mpool_init_undo(mpool);
+            return -1;
+        }
+        mpool_carve(mpool, hdr, chunk->data, chunk->num);
     }
 
-    char *buf_data;
-    if (ebuf)
-        buf_data = ebuf;
-    else
-        buf_data = ((mpool_elm_t *)p)->data;
-
-    for (size_t i=0; i<n; i++) {
-        TAILQ_INSERT_HEAD(  &mpool->hdr_free,
-                            (mpool_elm_t *)(buf_data + MPOOL_BLOCK_SIZE(data_size)*i),
-                            entry   );
+    if (attr->mag_size > 0) {
+        if (tss_create(&mpool->mag_key, mpool_mag_release) != thrd_success) {
+            errno = LIB_ERRNO_RES_LIMIT;    // PTHREAD_KEYS_MAX reached
+            mpool_init_undo(mpool);
+            return -1;
+        }
+        mpool->mag_size = attr->mag_size;
+        mpool->remote = (attr->flags & MPOOL_ATTR_REMOTE_FREE) ? 1 : 0;
+    }
+    if (attr->flags & MPOOL_ATTR_LOCKFREE) {
+        mpool->lockfree = 1;
+        mpool_lf_push_free(mpool);
     }
     return 0;
 }
@@ -142,6 +1025,8 @@ mpool_t* mpool_new(size_t data_size, size_t n, void *ebuf)
  * @brief   销毁内存池对象
  * @param   mpool   内存池对象指针
  * @return  成功返回0，失败返回-1并设置errno
+ *
+ * @attention   各线程的缓存随内存池一起释放，销毁后其他线程不得再访问该内存池
  */
 int mpool_destroy(mpool_t *mpool)
 {
@@ -150,18 +1035,47 @@ int mpool_destroy(mpool_t *mpool)
         return -1;
     }
     mtx_lock(&mpool->lock);
-    if (mpool->mode == MPOOL_MODE_DGROWN || mpool->mode == MPOOL_MODE_ISTATIC) {
-        mpool_elm_t *p;
-        TAILQ_FOREACH_REVERSE(p, &mpool->hdr_buf, __mpool_head, entry) {
-            TAILQ_REMOVE(&mpool->hdr_buf, p, entry);
-            free(p);
+    if (mpool->mag_size > 0) {
+        tss_delete(mpool->mag_key);
+        while (!TAILQ_EMPTY(&mpool->hdr_mag)) {
+            mpool_mag_t *mag = TAILQ_FIRST(&mpool->hdr_mag);
+            TAILQ_REMOVE(&mpool->hdr_mag, mag, entry);
+            free(mag);
         }
+        mpool->mag_size = 0;
+        mpool->remote = 0;
+    }
+    if (mpool->stats) {
+        tss_delete(mpool->stat_key);
+        while (!TAILQ_EMPTY(&mpool->hdr_tstat)) {
+            mpool_tstat_t *ts = TAILQ_FIRST(&mpool->hdr_tstat);
+            TAILQ_REMOVE(&mpool->hdr_tstat, ts, entry);
+            free(ts);
+        }
+        mpool->stats = 0;
+    }
+
+    while (!TAILQ_EMPTY(&mpool->hdr_buf)) {
+        mpool_chunk_t *chunk = TAILQ_FIRST(&mpool->hdr_buf);
+        TAILQ_REMOVE(&mpool->hdr_buf, chunk, entry);
+        mpool_chunk_free(chunk);
     }
+    free(mpool->chunk_idx);
+    mpool->chunk_idx = NULL;
+    mpool->chunk_cnt = 0;
+    mpool->chunk_cap = 0;
+    free(mpool->hdr_node);
+    mpool->hdr_node = NULL;
+    mpool->numa = 0;
 
     TAILQ_INIT(&mpool->hdr_free);
-    TAILQ_INIT(&mpool->hdr_used);
+    mpool->lockfree = 0;
+    mpool->lf_top = 0;
     mpool->sbuf = NULL;
     mpool->data_size = 0;
+    mpool->st_total = 0;
+    mpool->st_used = 0;
+    mpool->st_reserved = 0;
     mpool->mode = MPOOL_MODE_DESTROYED;
     mtx_unlock(&mpool->lock);
 
@@ -171,64 +1085,119 @@ int mpool_destroy(mpool_t *mpool)
 
 
 /**
- * @brief   从内存池中分配数据
- * @param   mpool   内存池对象指针
- *          size    想要分配的数据大小，如果size大于块的有效数据大小，则总是分配失败
- *
- * @return  成功返回块内有效数据的指针，失败返回NULL并设置errno
- *
- * @note    大块 = 大块的表头 + (N*块)，块 = 块的表头 + 有效数据区
- **/
-void* mpool_malloc(mpool_t *mpool, size_t size)
+ * @brief   内部函数，从内存池中分配数据（不计数），见mpool_malloc
+ */
+static void* mpool_do_malloc(mpool_t *mpool, size_t size)
 {
     if (mpool == NULL) {
         errno = EINVAL;
         return NULL;
     }
 
-    mtx_lock(&mpool->lock);
+    if (mpool->lockfree) {
+        if (size > mpool->data_size) {
+            errno = LIB_ERRNO_MBLK_SHORT;
+            return NULL;
+        }
+        mpool_elm_t *p = mpool_lf_get_block(mpool);
+        return p ? MPOOL_ELM_DATA(mpool, p) : NULL;
+    }
+
+    if (mpool->mag_size > 0 && size <= mpool->data_size) {
+        mpool_mag_t *mag = mpool_mag_get(mpool);
+        if (mag) {
+            if (mag->count == 0 && mpool->remote)
+                mpool_mag_reclaim(mpool, mag);
+            if (mag->count == 0)
+                mpool_mag_refill(mpool, mag);
+            if (mag->count == 0)
+                return NULL;    // errno has been set by refill
+            mpool_elm_t *p = mag->blocks[mag->count - 1];
+            __atomic_store_n(&mag->count, mag->count - 1, __ATOMIC_RELAXED);    // read by mpool_live
+            if (mpool->remote)
+                p->mag = mag;
+            return MPOOL_ELM_DATA(mpool, p);
+        }
+    }
+
+    MPOOL_LOCK(mpool);
     if (mpool->mode == MPOOL_MODE_MALLOC) {
-        mtx_unlock(&mpool->lock);
+        MPOOL_UNLOCK(mpool);
         return malloc(size);
     }
 
     if (size <= mpool->data_size) {
-        if (!TAILQ_EMPTY(&mpool->hdr_free)) {
-            mpool_elm_t *p = TAILQ_LAST(&mpool->hdr_free, __mpool_head);
-            TAILQ_REMOVE(&mpool->hdr_free, p, entry);
-            TAILQ_INSERT_HEAD(&mpool->hdr_used, p, entry);
-            mtx_unlock(&mpool->lock);
-            return p->data;
-        } else {
-            if (mpool->mode == MPOOL_MODE_DGROWN) {
-                size_t grown_size = MPOOL_BLOCK_SIZE(MPOOL_BLOCK_NUM_ALLOC *
-                                                        MPOOL_BLOCK_SIZE(mpool->data_size));
-                char *pbuf = (char *)malloc(grown_size);
-                if (pbuf) {
-                    TAILQ_INSERT_HEAD(&mpool->hdr_buf, (mpool_elm_t *)pbuf, entry);
-                    pbuf = ((mpool_elm_t *)pbuf)->data;
-                    size_t i;
-                    for (i=1; i<MPOOL_BLOCK_NUM_ALLOC; i++) {
-                        TAILQ_INSERT_HEAD(  &mpool->hdr_free,
-                                            (mpool_elm_t *)(pbuf+(i*MPOOL_BLOCK_SIZE(mpool->data_size))),
-                                            entry   );
-                    }
-                    TAILQ_INSERT_HEAD(&mpool->hdr_used, (mpool_elm_t *)pbuf, entry);
-                    mtx_unlock(&mpool->lock);
-                    return ((mpool_elm_t *)pbuf)->data;
-                }
-            }
-            mtx_unlock(&mpool->lock);
+        mpool_elm_t *p = mpool_get_block(mpool);
+        if (p == NULL) {
+            MPOOL_UNLOCK(mpool);
             errno = LIB_ERRNO_SHORT_MPOOL;
             return NULL;
         }
+        MPOOL_UNLOCK(mpool);
+        return MPOOL_ELM_DATA(mpool, p);
     } else {
-        mtx_unlock(&mpool->lock);
+        MPOOL_UNLOCK(mpool);
         errno = LIB_ERRNO_MBLK_SHORT;
         return NULL;
     }
 }
 
+/**
+ * @brief   内部函数，向内存池中释放数据（不计数），见mpool_free
+ */
+static void mpool_do_free(mpool_t *mpool, void *mem)
+{
+    if (mpool && mem) {
+        mpool_elm_t *p = MPOOL_DATA_ELM(mpool, mem);
+        if (mpool->lockfree) {
+            mpool_lf_push(mpool, p, p);
+            __atomic_fetch_sub(&mpool->st_used, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        if (mpool->mag_size > 0) {
+            mpool_mag_t *mag = mpool_mag_get(mpool);
+            if (mag) {
+                if (mpool->remote && p->mag && p->mag != mag) {
+                    mpool_mag_remote_push(p->mag, p);
+                    return;
+                }
+                if (mag->count == mpool->mag_size)
+                    mpool_mag_flush(mpool, mag);
+                mag->blocks[mag->count] = p;
+                __atomic_store_n(&mag->count, mag->count + 1, __ATOMIC_RELAXED);
+                return;
+            }
+        }
+
+        MPOOL_LOCK(mpool);
+        if (mpool->mode == MPOOL_MODE_MALLOC) {
+            MPOOL_UNLOCK(mpool);
+            free(mem);
+            return;
+        }
+        mpool_put_block(mpool, p);
+        MPOOL_UNLOCK(mpool);
+    }
+}
+
+/**
+ * @brief   从内存池中分配数据
+ * @param   mpool   内存池对象指针
+ *          size    想要分配的数据大小，如果size大于块的有效数据大小，则总是分配失败
+ *
+ * @return  成功返回块内有效数据的指针，失败返回NULL并设置errno
+ *
+ * @note    大块 = 大块的表头 + (N*块)，块只有有效数据区（远程释放模式下另有块的表头）；
+ *          启用线程缓存时，优先从当前线程的缓存中无锁分配，缓存为空时先收回收件箱中的块；无锁模式下直接从空闲栈弹出
+ **/
+void* mpool_malloc(mpool_t *mpool, size_t size)
+{
+    void *mem = mpool_do_malloc(mpool, size);
+    if (mpool && mpool->stats)
+        mpool_stat_count(mpool, mem ? 1 : 0, 0, mem == NULL && errno == LIB_ERRNO_SHORT_MPOOL);
+    return mem;
+}
+
 /**
  * @brief   向内存池中释放数据
  * @param   mpool   内存池对象指针
@@ -236,25 +1205,279 @@ void* mpool_malloc(mpool_t *mpool, size_t size)
  *
  * @return  void
  *
- * @note    程序将mem指向的地址减去一个偏移就得到了块指针
+ * @note    块指针就是mem（远程释放模式下mem减去块表头的大小）；
+ *          启用线程缓存时，块优先放入当前线程的缓存，缓存已满时才批量归还共享链表；
+ *          远程释放模式下，由其他线程缓存分配的块放入该线程缓存的收件箱；
+ *          无锁模式下直接压入空闲栈
  **/
 void mpool_free(mpool_t *mpool, void *mem)
 {
-    if (mpool && mem) {
-        mtx_lock(&mpool->lock);
-        if (mpool->mode == MPOOL_MODE_MALLOC) {
-            mtx_unlock(&mpool->lock);
-            free(mem);
-            return;
+    mpool_do_free(mpool, mem);
+    if (mpool && mem && mpool->stats)
+        mpool_stat_count(mpool, 0, 1, 0);
+}
+
+/**
+ * @brief   从内存池中批量分配块，整批只加锁一次
+ * @param   mpool   内存池对象指针
+ *          n       想要分配的块数，不超过INT_MAX
+ *          ptrs    输出每个块的有效数据指针，至少能容纳n个指针
+ *
+ * @return  成功返回实际分配的块数（内存池耗尽时可能小于n，此时设置errno），失败返回-1并设置errno
+ *
+ * @note    每块的有效数据大小为内存池的data_size；分配绕过线程缓存，直接访问共享链表；
+ *          无锁模式下每块各需一次CAS（避免一次性摘下整个栈导致其他线程误判为空）
+ *
+ * @attention   系统模式（MPOOL_MODE_MALLOC）没有固定的块大小，不支持批量分配，返回EINVAL，应逐个调用mpool_malloc
+ */
+int mpool_malloc_bulk(mpool_t *mpool, size_t n, void *ptrs[])
+{
+    if (mpool == NULL || (n > 0 && ptrs == NULL) || n > INT_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t i = 0;
+    mpool_elm_t *p;
+    if (mpool->mode == MPOOL_MODE_MALLOC) {
+        errno = EINVAL;     // no block size to allocate
+        return -1;
+    } else if (mpool->lockfree) {
+        for (; i<n && (p = mpool_lf_get_block(mpool)) != NULL; i++) {
+            ptrs[i] = MPOOL_ELM_DATA(mpool, p);
         }
-        mpool_elm_t *p = CONTAINER_OF(mem, mpool_elm_t, data);
-        TAILQ_REMOVE(&mpool->hdr_used, p, entry);
-        TAILQ_INSERT_HEAD(&mpool->hdr_free, p, entry);
-        mtx_unlock(&mpool->lock);
+    } else {
+        MPOOL_LOCK(mpool);
+        for (; i<n && (p = mpool_get_block(mpool)) != NULL; i++) {
+            ptrs[i] = MPOOL_ELM_DATA(mpool, p);
+        }
+        int ec = errno;
+        MPOOL_UNLOCK(mpool);
+        errno = ec;
+    }
+    if (mpool->stats)
+        mpool_stat_count(mpool, i, 0, i < n);
+    return (int)i;
+}
+
+/**
+ * @brief   向内存池中批量释放块，整批只加锁一次
+ * @param   mpool   内存池对象指针
+ *          n       要释放的块数
+ *          ptrs    每个块的有效数据指针，NULL指针会被忽略
+ *
+ * @return  void
+ *
+ * @note    释放绕过线程缓存，直接放回共享链表；无锁模式下整批块先串成一条链，再通过一次CAS压入空闲栈
+ */
+void mpool_free_bulk(mpool_t *mpool, size_t n, void *ptrs[])
+{
+    if (mpool == NULL || ptrs == NULL || n == 0)
+        return;
+
+    size_t i;
+    if (mpool->mode == MPOOL_MODE_MALLOC) {
+        for (i=0; i<n; i++) {
+            free(ptrs[i]);
+        }
+    } else if (mpool->lockfree) {
+        mpool_elm_t *first = NULL, *last = NULL;
+        size_t frees = 0;
+        for (i=0; i<n; i++) {
+            if (ptrs[i] == NULL)
+                continue;
+            frees++;
+            mpool_elm_t *p = MPOOL_DATA_ELM(mpool, ptrs[i]);
+            if (last)
+                __atomic_store_n(&last->entry.tqe_next, p, __ATOMIC_RELAXED);
+            else
+                first = p;
+            last = p;
+        }
+        if (first) {
+            mpool_lf_push(mpool, first, last);
+            __atomic_fetch_sub(&mpool->st_used, frees, __ATOMIC_RELAXED);
+        }
+    } else {
+        MPOOL_LOCK(mpool);
+        for (i=0; i<n; i++) {
+            if (ptrs[i])
+                mpool_put_block(mpool, MPOOL_DATA_ELM(mpool, ptrs[i]));
+        }
+        MPOOL_UNLOCK(mpool);
+    }
+    if (mpool->stats) {
+        size_t frees = 0;
+        for (i=0; i<n; i++) {
+            if (ptrs[i])
+                frees++;
+        }
+        mpool_stat_count(mpool, 0, frees, 0);
+    }
+}
+
+/**
+ * @brief   读取内存池统计
+ * @param   mpool   内存池对象指针
+ *          st      输出的统计
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ *
+ * @note    总块数、live、高水位、自增长次数与申请字节数总是有效；分配、释放、失败与锁等待计数需要MPOOL_ATTR_STATS，
+ *          未开启时为0，此时live为不在共享空闲链表、也不在线程缓存中的块数（远程释放后尚未收回的块仍计入）。
+ *          各线程的计数在读取时汇总，读取期间仍在进行的分配与释放可能只被部分计入。
+ *          启用线程缓存时，线程缓存内的分配与释放不经过共享链表，高水位在补充线程缓存和每次读取时采样，
+ *          是实际峰值的近似值（偏低）；其他模式下高水位是精确的。
+ *          单属主模式下必须由属主调用
+ *
+ *          用于确定MPOOL_INIT_ISTATIC的块数时，取运行一段时间后的hwm即可
+ */
+int mpool_stats(mpool_t *mpool, mpool_stats_t *st)
+{
+    if (mpool == NULL || st == NULL || mpool->mode == MPOOL_MODE_DESTROYED) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(st, 0, sizeof(mpool_stats_t));
+    MPOOL_LOCK(mpool);
+    if (mpool->stats) {
+        mpool_tstat_t *ts;
+        uint64_t wait_ns = mpool->tstat_exit.wait_ns;
+        st->allocs = mpool->tstat_exit.allocs;
+        st->frees = mpool->tstat_exit.frees;
+        st->fails = mpool->tstat_exit.fails;
+        st->contended = mpool->tstat_exit.contended;
+        TAILQ_FOREACH(ts, &mpool->hdr_tstat, entry) {
+            st->allocs += __atomic_load_n(&ts->allocs, __ATOMIC_RELAXED);
+            st->frees += __atomic_load_n(&ts->frees, __ATOMIC_RELAXED);
+            st->fails += __atomic_load_n(&ts->fails, __ATOMIC_RELAXED);
+            st->contended += __atomic_load_n(&ts->contended, __ATOMIC_RELAXED);
+            wait_ns += __atomic_load_n(&ts->wait_ns, __ATOMIC_RELAXED);
+        }
+        st->lock_wait = (double)wait_ns / 1e9;
+        st->live = (st->allocs > st->frees) ? (size_t)(st->allocs - st->frees) : 0;
+    } else {
+        st->live = mpool_live(mpool);
+    }
+    mpool_hwm_update(mpool, st->live);
+
+    st->total = mpool->st_total;
+    st->free = (st->total > st->live) ? st->total - st->live : 0;
+    st->hwm = mpool->st_hwm;
+    st->grows = mpool->st_grows;
+    st->reserved = mpool->st_reserved;
+    MPOOL_UNLOCK(mpool);
+    return 0;
+}
+
+/**
+ * @brief   内部函数，释放块全部空闲、且已连续idle_passes次整理时全部空闲的大块
+ * @param   mpool       内存池对象指针
+ *          idle_passes 大块需要连续全部空闲的整理次数，0表示立即释放
+ *
+ * @return  成功返回释放的大块数，失败返回-1并设置errno
+ */
+static int mpool_trim_idle(mpool_t *mpool, unsigned idle_passes)
+{
+    if (mpool == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (mpool->lockfree) {
+        errno = ENOTSUP;    // a concurrent pop may still read a released block
+        return -1;
     }
+
+    MPOOL_LOCK(mpool);
+    if (mpool->mode != MPOOL_MODE_DGROWN || TAILQ_EMPTY(&mpool->hdr_buf)) {
+        MPOOL_UNLOCK(mpool);
+        return 0;
+    }
+
+    /* count free blocks of each chunk, found through the sorted chunk index */
+    mpool_chunk_t *chunk, *cnext;
+    TAILQ_FOREACH(chunk, &mpool->hdr_buf, entry) {
+        chunk->nfree = 0;
+    }
+    int nhdr = mpool->numa ? MPOOL_NUMA_NODE_MAX : 1;
+    mpool_head_t *hdrs = mpool->numa ? mpool->hdr_node : &mpool->hdr_free;
+    mpool_elm_t *p, *next;
+    for (int i=0; i<nhdr; i++) {
+        TAILQ_FOREACH(p, &hdrs[i], entry) {
+            if ((chunk = mpool_chunk_find(mpool, p)) != NULL)
+                chunk->nfree++;
+        }
+    }
+
+    /* mark releasable chunks: nfree == num means "release" below, kept idle chunks get nfree = 0 */
+    int released = 0;
+    TAILQ_FOREACH(chunk, &mpool->hdr_buf, entry) {
+        if (chunk->nfree < chunk->num) {
+            chunk->idle = 0;
+        } else if (chunk->idle++ >= idle_passes) {
+            released++;
+        } else {
+            chunk->nfree = 0;
+        }
+    }
+
+    if (released > 0) {
+        /* unlink the free blocks while the chunk index is still complete */
+        for (int i=0; i<nhdr; i++) {
+            for (p = TAILQ_FIRST(&hdrs[i]); p; p = next) {
+                next = TAILQ_NEXT(p, entry);
+                chunk = mpool_chunk_find(mpool, p);
+                if (chunk && chunk->nfree == chunk->num)
+                    TAILQ_REMOVE(&hdrs[i], p, entry);
+            }
+        }
+        for (chunk = TAILQ_FIRST(&mpool->hdr_buf); chunk; chunk = cnext) {
+            cnext = TAILQ_NEXT(chunk, entry);
+            if (chunk->nfree == chunk->num) {
+                TAILQ_REMOVE(&mpool->hdr_buf, chunk, entry);
+                mpool_chunk_index_del(mpool, chunk);
+                mpool->st_total -= chunk->num;
+                mpool->st_reserved -= chunk->size;
+                mpool_chunk_free(chunk);
+            }
+        }
+    }
+    MPOOL_UNLOCK(mpool);
+    return released;
+}
+
+/**
+ * @brief   整理内存池，把块已全部空闲的大块归还系统
+ * @param   mpool   内存池对象指针
+ *
+ * @return  成功返回释放的大块数，失败返回-1并设置errno
+ *
+ * @note    只对自增长模式有效，其他模式总是返回0；无锁模式下不支持整理，返回-1且errno为ENOTSUP。
+ *          线程缓存中的块对内存池而言属于已用块，所以缓存着块的大块不会被释放。
+ *          函数只在整理时加锁遍历空闲链表，不会增加分配与释放的开销
+ */
+int mpool_trim(mpool_t *mpool)
+{
+    return mpool_trim_idle(mpool, 0);
+}
+
+/**
+ * @brief   周期整理策略，参数为内存池对象指针，可以直接注册为定时器的回调函数
+ * @param   arg     内存池对象指针
+ * @return  void
+ *
+ * @note    大块在此前连续MPOOL_TRIM_IDLE_PASSES次整理中都已全部空闲，本次才会被释放，避免流量抖动时反复申请与释放
+ * @par     举例：
+ * @code
+ * TMR_ADD(MY_TMR_ID_TRIM, TMR_EVENT_TYPE_PERIODIC, 10.0, mpool_trim_proc, &mypool);
+ * @endcode
+ */
+void mpool_trim_proc(void *arg)
+{
+    mpool_trim_idle((mpool_t *)arg, MPOOL_TRIM_IDLE_PASSES);
 }
 
 #ifdef __cplusplus
 }
 #endif
-
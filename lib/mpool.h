@@ -5,17 +5,38 @@
  *
  *          内存池空间可以来自外部已分配好的较大buffer，也可以由模块内部自动malloc一块较大内存；\n
  *          内存池大小可以由外部指定，也可以任由模块自动增长（即当内存池为空或耗尽时，
- *          模块自动向系统一次性申请包含N个块的较大内存块）
+ *          模块自动向系统一次性申请包含N个块的较大内存块，N从MPOOL_BLOCK_NUM_ALLOC开始每次翻倍直到上限）
  *          内存池每个小块的大小（即申请与释放的固定块大小）必须外部指定，否则将与malloc等效
  *
- *          内存池从系统malloc到的内存块不会被free，直到内存池管理对象被销毁(mpool_destroy)
+ *          内存池从系统malloc到的内存块不会被free，直到内存池管理对象被销毁(mpool_destroy)，
+ *          或者通过mpool_trim把块已全部空闲的大块归还系统
  *
  *          使用时只需要先初始化mpool_init，之后便可以进行“分配”mpool_malloc与“释放”mpool_free
+ *
+ *          通过mpool_init_ex可以为每个线程开启一个小的块缓存(magazine)，线程在缓存内分配与释放块时无需加锁，
+ *          只有在缓存为空或已满时才批量地访问内存池的共享链表；再指定MPOOL_ATTR_REMOTE_FREE时，
+ *          线程释放其他线程分配的块会把块无锁地放入分配线程的收件箱，由分配线程在缓存耗尽时批量收回；
+ *          也可以指定MPOOL_ATTR_LOCKFREE，此时空闲块构成一个无锁栈，分配与释放各只需一次CAS
+ *
+ *          块没有表头：空闲块的链表指针就存放在块的有效数据区中，已分配的块不占用任何额外空间；
+ *          需要由块反查所属大块时（例如NUMA节点），通过大块的地址区间查找。
+ *          只有远程释放模式需要在已分配块前保留一个表头，用于记录分配该块的线程缓存
+ *
+ *          mpool_malloc_bulk/mpool_free_bulk整批只加锁一次（无锁模式下释放只需一次CAS）；
+ *          系统模式没有固定的块大小，mpool_malloc_bulk不可用（返回EINVAL），只能逐个mpool_malloc
+ *
+ *          指定MPOOL_ATTR_STATS时，每个线程各自累计分配、释放、失败与锁等待的计数，mpool_stats读取时再汇总，
+ *          计数本身不引入任何共享写
+ *
+ *          线程缓存与每线程计数各占用一个pthread TSS键，直到mpool_destroy归还；键是进程级资源，
+ *          总数受PTHREAD_KEYS_MAX限制（glibc为1024，并与进程中的其他模块共享），
+ *          键耗尽时mpool_init_ex返回LIB_ERRNO_RES_LIMIT；大量的小内存池不宜开启这两项
  */
 
 #ifndef __MEMORY_POOL__
 #define __MEMORY_POOL__
 
+#include <stdint.h>
 #include "sysque.h"
 #include "threads_c11.h"
 
@@ -31,29 +52,177 @@ enum {
     MPOOL_MODE_ESTATIC          ///< 外部模式：由外部参数传入一个内存块
 };
 
+/**
+ * 块的表头，与块的有效数据区重叠（即空闲块的前sizeof(mpool_elm_t)字节）；
+ * 远程释放模式下表头位于有效数据之前，已分配块仍保留mag字段
+ */
 typedef struct __mpool_elm {
-    TAILQ_ENTRY(__mpool_elm)    entry;      ///< 块的表头，块与块基于此构成一张链表
-    char                        data[];     ///< 块的有效数据
+    union {
+        TAILQ_ENTRY(__mpool_elm) entry;     ///< 块的表头，空闲块基于此构成一张链表
+        struct {
+            struct __mpool_mag  *mag;       ///< 远程释放模式下，从线程缓存分配出去的块所属的线程缓存
+            struct __mpool_elm  *rnext;     ///< 远程释放收件箱中的下一个块
+        };
+    };
 } mpool_elm_t;
 
 typedef TAILQ_HEAD(__mpool_head, __mpool_elm) mpool_head_t;
 
+/// 大块：内存池一次性向系统申请、再分割为小块的内存
+typedef struct __mpool_chunk {
+    TAILQ_ENTRY(__mpool_chunk)  entry;      ///< 所有大块构成一张链表
+    size_t                      size;       ///< 大块的总大小（含表头）
+    size_t                      num;        ///< 大块中的块数
+    int                         mmapped;    ///< 大块是否由mmap分配
+    int                         node;       ///< NUMA模式下大块所属的节点
+    unsigned                    idle;       ///< 连续多少次整理时大块中的块全部空闲（仅由mpool_trim访问）
+    size_t                      nfree;      ///< 整理时统计的空闲块数（仅由mpool_trim访问）
+    char                        data[];     ///< 大块的数据区
+} mpool_chunk_t;
+
+typedef TAILQ_HEAD(__mpool_chunk_head, __mpool_chunk) mpool_chunk_head_t;
+
+/// 线程块缓存，缓存中的块对内存池而言属于已用块
+typedef struct __mpool_mag {
+    TAILQ_ENTRY(__mpool_mag)    entry;      ///< 内存池中所有缓存构成一张链表
+    struct __mpool              *mpool;     ///< 缓存所属的内存池
+    mpool_elm_t                 *inbox;     ///< 远程释放收件箱：其他线程释放的、由本缓存分配的块（无锁栈）
+    int                         dead;       ///< 远程释放模式下，所属线程已退出，缓存等待被新线程复用
+    size_t                      count;      ///< 缓存中的块数
+    mpool_elm_t                 *blocks[];  ///< 缓存的块（是一个栈）
+} mpool_mag_t;
+
+typedef TAILQ_HEAD(__mpool_mag_head, __mpool_mag) mpool_mag_head_t;
+
+/// 每线程的统计计数，只由所属线程写入
+typedef struct __mpool_tstat {
+    TAILQ_ENTRY(__mpool_tstat)  entry;      ///< 内存池中所有线程的计数构成一张链表
+    struct __mpool              *mpool;     ///< 计数所属的内存池
+    uint64_t                    allocs;     ///< 分配成功次数
+    uint64_t                    frees;      ///< 释放次数
+    uint64_t                    fails;      ///< 因内存池耗尽而失败的分配次数
+    uint64_t                    contended;  ///< 加锁时锁已被占用的次数
+    uint64_t                    wait_ns;    ///< 等待锁的总时间（纳秒）
+} mpool_tstat_t;
+
+typedef TAILQ_HEAD(__mpool_tstat_head, __mpool_tstat) mpool_tstat_head_t;
+
+/// 内存池属性标志：空闲块使用无锁栈（Treiber stack）管理，与线程缓存互斥
+#define MPOOL_ATTR_LOCKFREE             0x1
+/// 内存池属性标志：按NUMA节点分别管理空闲块，增长时从分配线程所在节点申请内存，与无锁模式互斥
+#define MPOOL_ATTR_NUMA                 0x2
+/// 内存池属性标志：不小于MPOOL_HUGEPAGE_SIZE的大块优先使用大页（MAP_HUGETLB，失败时退回透明大页）
+#define MPOOL_ATTR_HUGEPAGE             0x4
+/// 内存池属性标志：单属主模式，内存池只由一个线程使用，不加锁，与线程缓存、无锁模式互斥
+#define MPOOL_ATTR_SINGLE               0x8
+/// 内存池属性标志：远程释放，块由非分配线程释放时放入分配线程的收件箱，需要同时启用线程缓存
+#define MPOOL_ATTR_REMOTE_FREE          0x10
+/// 内存池属性标志：开启每线程的分配、释放、失败与锁等待计数，通过mpool_stats读取
+#define MPOOL_ATTR_STATS                0x20
+
+/// 内存池初始化属性
+typedef struct {
+    size_t          mag_size;   ///< 每线程缓存的块数，0表示不启用线程缓存
+    int             flags;      ///< 属性标志，MPOOL_ATTR_xxx
+    size_t          align;      ///< 块有效数据的对齐字节数（2的幂），0表示按int对齐
+    size_t          grow_max;   ///< 自增长模式下单次增长的最大块数，0表示按MPOOL_GROW_SIZE_MAX计算
+} mpool_attr_t;
+
+/// 内存池统计，由mpool_stats填写
+typedef struct {
+    size_t          total;      ///< 内存池的总块数
+    size_t          live;       ///< 用户持有的块数
+    size_t          free;       ///< 空闲块数（总块数 - 用户持有的块数，含线程缓存中的块）
+    size_t          hwm;        ///< 高水位：用户同时持有的最大块数（启用线程缓存时为采样值）
+    size_t          grows;      ///< 自增长次数
+    size_t          reserved;   ///< 向系统申请的字节数（外部模式的buffer不计入）
+    uint64_t        allocs;     ///< 分配成功次数
+    uint64_t        frees;      ///< 释放次数
+    uint64_t        fails;      ///< 因内存池耗尽(LIB_ERRNO_SHORT_MPOOL)而失败的分配次数
+    uint64_t        contended;  ///< 加锁时锁已被占用的次数
+    double          lock_wait;  ///< 等待锁的总时间（秒）
+} mpool_stats_t;
+
 typedef struct __mpool {
     mpool_head_t    hdr_free;   ///< 总空闲块（是一张链表）
-    mpool_head_t    hdr_used;   ///< 总已用块（是一张链表）
     mtx_t           lock;       ///< 互斥锁
     size_t          data_size;  ///< 块内有效数据的大小（不是块的总大小）
-    mpool_head_t    hdr_buf;    ///< 所有malloc到的大块（是一张链表）
+    mpool_chunk_head_t  hdr_buf;    ///< 所有malloc到的大块（是一张链表）
+    mpool_chunk_t   **chunk_idx;    ///< 按地址排序的大块索引，用于由块地址查找所属大块
+    size_t          chunk_cnt;      ///< 大块索引中的大块数
+    size_t          chunk_cap;      ///< 大块索引的容量
     char*           sbuf;       ///< 指向外部给定的buffer
     int             mode;       ///< 内存池工作模式
+
+    size_t              align;      ///< 块有效数据的对齐字节数
+    size_t              block_size; ///< 相邻两块的间距（对齐后的块大小）
+    size_t              block_off;  ///< 块表头相对块起始地址的偏移（块表头之前是对齐填充）
+    size_t              hdr_size;   ///< 已分配块的表头大小，只有远程释放模式不为0
+
+    size_t              grow_num;   ///< 自增长模式下下一次增长的块数（每次增长后翻倍）
+    size_t              grow_max;   ///< 自增长模式下单次增长的最大块数
+    int                 hugepage;   ///< 大块是否使用大页
+
+    int                 single;     ///< 是否为单属主模式（不加锁）
+    int                 owner_bound;///< 单属主模式下是否已绑定属主（仅调试版本使用）
+    thrd_t              owner;      ///< 单属主模式下的属主线程（仅调试版本使用）
+
+    int                 numa;       ///< 是否为NUMA模式
+    mpool_head_t        *hdr_node;  ///< NUMA模式下每个节点的空闲块（MPOOL_NUMA_NODE_MAX张链表）
+
+    size_t              mag_size;   ///< 每线程缓存的块数，0表示不启用
+    tss_t               mag_key;    ///< 线程缓存的TSS键
+    int                 remote;     ///< 是否为远程释放模式
+    mpool_mag_head_t    hdr_mag;    ///< 所有线程缓存（是一张链表）
+
+    int                 lockfree;   ///< 是否为无锁模式
+    uint64_t            lf_top;     ///< 无锁模式下空闲栈的栈顶（带ABA计数的指针）
+
+    size_t              st_total;   ///< 总块数（加锁维护）
+    size_t              st_used;    ///< 不在共享空闲链表中的块数（加锁维护，无锁模式下原子地维护）
+    size_t              st_hwm;     ///< 用户同时持有的最大块数
+    size_t              st_grows;   ///< 自增长次数
+    size_t              st_reserved;///< 向系统申请的字节数
+    int                 stats;      ///< 是否开启每线程计数
+    tss_t               stat_key;   ///< 每线程计数的TSS键
+    mpool_tstat_head_t  hdr_tstat;  ///< 所有线程的计数（是一张链表）
+    mpool_tstat_t       tstat_exit; ///< 已退出线程的计数之和
 } mpool_t;
 
-/// 内存池在自增长时一次性malloc的总块数
+/// 内存池在第一次自增长时一次性malloc的总块数，此后每次增长的块数翻倍
 #define MPOOL_BLOCK_NUM_ALLOC           256
-/// 块大小（块的表头 + 块的有效数据）
-#define MPOOL_BLOCK_SIZE(data_size)     (sizeof(mpool_elm_t) + data_size)
+/// 默认的单次增长上限（字节），单次增长的块数不超过此值对应的块数（但不少于MPOOL_BLOCK_NUM_ALLOC）
+#define MPOOL_GROW_SIZE_MAX             (32*1024*1024)
+/// mpool_trim_proc释放大块前，大块此前需要连续全部空闲的整理次数
+#define MPOOL_TRIM_IDLE_PASSES          2
+/// 大页大小
+#define MPOOL_HUGEPAGE_SIZE             (2*1024*1024)
+/**
+ * 无锁栈的栈顶是“计数+指针”打包成的64位值，计数用于避免ABA问题；
+ * 64位系统下用户空间地址不超过48位，剩余高16位作为计数
+ */
+#if UINTPTR_MAX > 0xffffffffUL
+#define MPOOL_LF_PTR_BITS               48
+#else
+#define MPOOL_LF_PTR_BITS               32
+#endif
+
+/// NUMA模式下支持的最大节点数，节点号超出时取模
+#define MPOOL_NUMA_NODE_MAX             8
+/// 默认对齐：按int对齐
+#define MPOOL_ALIGN_DEF                 sizeof(int)
+/// 缓存行对齐
+#define MPOOL_ALIGN_CACHELINE           64
+
+/// 线程缓存的最大块数
+#define MPOOL_MAG_SIZE_MAX              1024
+/// 块大小（块没有表头，但空闲块需要在有效数据区中存放链表指针，远程释放模式另需加上sizeof(mpool_elm_t)）
+#define MPOOL_BLOCK_SIZE(data_size) \
+    ((data_size) > sizeof(mpool_elm_t) ? (data_size) : sizeof(mpool_elm_t))
 /// 长度按int对齐
 #define MPOOL_ALIGN_SIZE(len)           ((len) ? ((((len)-1) / sizeof(int)) + 1) * sizeof(int) : 0)
+/// 长度按a对齐（a必须是2的幂）
+#define MPOOL_ALIGN_UP(len, a)          (((len) + ((a)-1)) & ~((size_t)(a)-1))
 
 #define MPOOL_INIT_MALLOC(mpl)          mpool_init(mpl,0,0,0)
 #define MPOOL_INIT(mpl)                 MPOOL_INIT_MALLOC(mpl)
@@ -64,13 +233,25 @@ typedef struct __mpool {
 
 #define MPOOL_INIT_ESTATIC(mpl,s,n,e)   mpool_init(mpl,s,n,e)
 
+extern void         mpool_attr_init(mpool_attr_t *attr);
+
 extern int          mpool_init(mpool_t *mpool, size_t data_size, size_t n, void *ebuf);
+extern int          mpool_init_ex(mpool_t *mpool, size_t data_size, size_t n, void *ebuf,
+                                  const mpool_attr_t *attr);
 extern mpool_t*     mpool_new(size_t data_size, size_t n, void *ebuf);
 extern int          mpool_destroy(mpool_t *mpool);
 
 extern void*        mpool_malloc(mpool_t *mpool, size_t size);
 extern void         mpool_free(mpool_t *mpool, void *mem);
 
+extern int          mpool_malloc_bulk(mpool_t *mpool, size_t n, void *ptrs[]);
+extern void         mpool_free_bulk(mpool_t *mpool, size_t n, void *ptrs[]);
+
+extern int          mpool_stats(mpool_t *mpool, mpool_stats_t *st);
+
+extern int          mpool_trim(mpool_t *mpool);
+extern void         mpool_trim_proc(void *arg);
+
 #ifdef __cplusplus
 }
 #endif
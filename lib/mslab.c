@@ -0,0 +1,183 @@
+/**
+ * @file    mslab.c
+ * @author  ln
+ * @brief   多规格内存分配器，按数据大小把请求分发到不同规格的内存池\n
+ *
+ *          规格从32字节到64KB，每翻一倍有两档（2^k 和 1.5*2^k），每一档由一个自增长模式的mpool_t提供；
+ *          超过最大规格的请求直接使用系统malloc
+ *
+ *          每块数据前有一个很小的表头记录所属规格，所以释放时不需要指定大小
+ *
+ *          使用时只需要先初始化mslab_init，之后便可以进行“分配”mslab_malloc与“释放”mslab_free
+ */
+
+#include "mslab.h"
+#include "err.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define OFFSET_OF(TYPE, MEMBER)             ((size_t)&((TYPE *)0)->MEMBER)
+#define CONTAINER_OF(ptr, type, member)     ((type *)((char *)(ptr) - OFFSET_OF(type,member)))
+
+/// 规格MSLAB_SIZE_MIN所对应的2的幂次
+#define MSLAB_SHIFT_MIN         5
+
+/**
+ * @brief   内部函数，计算数据大小所对应的规格
+ * @param   size    数据大小
+ * @return  规格序号，超过最大规格时返回MSLAB_CLASS_MALLOC
+ *
+ * @note    设 2^b < size <= 2^(b+1)，则size落在 1.5*2^b 或 2^(b+1) 这两档之一
+ */
+static size_t mslab_size_class(size_t size)
+{
+    if (size <= MSLAB_SIZE_MIN)
+        return 0;
+    if (size > MSLAB_SIZE_MAX)
+        return MSLAB_CLASS_MALLOC;
+
+    size_t b = 0;
+    for (size_t n = size - 1; n > 1; n >>= 1) {
+        b++;
+    }
+    size_t half = ((size_t)1 << b) + ((size_t)1 << (b - 1));
+    if (size <= half)
+        return (b - MSLAB_SHIFT_MIN) * 2 + 1;
+    else
+        return (b + 1 - MSLAB_SHIFT_MIN) * 2;
+}
+
+/**
+ * @brief   获取某个规格的数据大小
+ * @param   cls     规格序号
+ * @return  规格的数据大小，序号无效时返回0
+ */
+size_t mslab_class_size(size_t cls)
+{
+    if (cls >= MSLAB_CLASS_NUM)
+        return 0;
+    size_t base = (size_t)MSLAB_SIZE_MIN << (cls / 2);
+    return (cls % 2) ? base + base / 2 : base;
+}
+
+/**
+ * @brief   初始化多规格内存分配器
+ * @param   slab    分配器对象
+ *          attr    每个规格内存池的属性（例如线程缓存），NULL表示默认属性
+ *
+ * @return  成功返回0，失败返回-1并设置errno（TSS键耗尽时为LIB_ERRNO_RES_LIMIT）
+ *
+ * @note    开启线程缓存或计数时，每个规格各占用一个TSS键，见mslab.h
+ */
+int mslab_init(mslab_t *slab, const mpool_attr_t *attr)
+{
+    if (slab == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (size_t i=0; i<MSLAB_CLASS_NUM; i++) {
+        size_t data_size = sizeof(mslab_elm_t) + mslab_class_size(i);
+        if (mpool_init_ex(&slab->pools[i], data_size, 0, NULL, attr) != 0) {
+            int ec = errno;
+            while (i-- > 0) {
+                mpool_destroy(&slab->pools[i]);
+            }
+            errno = ec;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief   新建多规格内存分配器
+ * @param   attr    每个规格内存池的属性，NULL表示默认属性
+ *
+ * @return      成功返回分配器对象指针，失败返回NULL
+ * @attention   返回的对象需要free
+ */
+mslab_t* mslab_new(const mpool_attr_t *attr)
+{
+    mslab_t *slab = (mslab_t *)malloc(sizeof(mslab_t));
+    if (slab == NULL)
+        return NULL;
+
+    if (mslab_init(slab, attr) != 0) {
+        free(slab);
+        slab = NULL;
+    }
+    return slab;
+}
+
+/**
+ * @brief   销毁多规格内存分配器，所有规格的内存池一并销毁
+ * @param   slab    分配器对象
+ * @return  成功返回0，失败返回-1并设置errno
+ *
+ * @attention   通过malloc分配的超大块不在内存池中，需要在销毁前自行mslab_free
+ */
+int mslab_destroy(mslab_t *slab)
+{
+    if (slab == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (size_t i=0; i<MSLAB_CLASS_NUM; i++) {
+        mpool_destroy(&slab->pools[i]);
+    }
+    return 0;
+}
+
+/**
+ * @brief   分配数据
+ * @param   slab    分配器对象
+ *          size    想要分配的数据大小
+ *
+ * @return  成功返回有效数据的指针，失败返回NULL并设置errno
+ */
+void* mslab_malloc(mslab_t *slab, size_t size)
+{
+    if (slab == NULL || size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    mslab_elm_t *p;
+    size_t cls = mslab_size_class(size);
+    if (cls == MSLAB_CLASS_MALLOC)
+        p = (mslab_elm_t *)malloc(sizeof(mslab_elm_t) + size);
+    else
+        p = (mslab_elm_t *)mpool_malloc(&slab->pools[cls], sizeof(mslab_elm_t) + size);
+    if (p == NULL)
+        return NULL;
+
+    p->cls = cls;
+    return p->data;
+}
+
+/**
+ * @brief   释放数据
+ * @param   slab    分配器对象
+ *          mem     要释放的有效数据指针，必须由同一个分配器的mslab_malloc返回
+ *
+ * @return  void
+ */
+void mslab_free(mslab_t *slab, void *mem)
+{
+    if (slab && mem) {
+        mslab_elm_t *p = CONTAINER_OF(mem, mslab_elm_t, data);
+        if (p->cls == MSLAB_CLASS_MALLOC)
+            free(p);
+        else
+            mpool_free(&slab->pools[p->cls], p);
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
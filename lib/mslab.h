@@ -0,0 +1,60 @@
+/**
+ * @file    mslab.h
+ * @author  ln
+ * @brief   多规格内存分配器，按数据大小把请求分发到不同规格的内存池\n
+ *
+ *          规格从32字节到64KB，每翻一倍有两档（2^k 和 1.5*2^k），每一档由一个自增长模式的mpool_t提供；
+ *          超过最大规格的请求直接使用系统malloc
+ *
+ *          每块数据前有一个很小的表头记录所属规格，所以释放时不需要指定大小
+ *
+ *          使用时只需要先初始化mslab_init，之后便可以进行“分配”mslab_malloc与“释放”mslab_free
+ *
+ * @attention   mslab_init的属性作用于全部MSLAB_CLASS_NUM个内存池：开启线程缓存（mag_size）时每个分配器占用23个
+ *              pthread TSS键，再开启MPOOL_ATTR_STATS时占用46个（见mpool.h），受PTHREAD_KEYS_MAX（glibc为1024）限制，
+ *              一个进程中只能有几十个这样的分配器，适合少量长期存在的共享分配器；默认属性的分配器不占用TSS键
+ */
+
+#ifndef __MEMORY_SLAB__
+#define __MEMORY_SLAB__
+
+#include "mpool.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// 最小规格
+#define MSLAB_SIZE_MIN          32
+/// 最大规格
+#define MSLAB_SIZE_MAX          65536
+/// 规格数：32,48,64,96,...,32768,49152,65536
+#define MSLAB_CLASS_NUM         23
+/// 超过最大规格的块，直接使用malloc
+#define MSLAB_CLASS_MALLOC      MSLAB_CLASS_NUM
+
+typedef struct {
+    size_t          cls;        ///< 块所属的规格
+    char            data[];     ///< 块的有效数据
+} mslab_elm_t;
+
+typedef struct {
+    mpool_t         pools[MSLAB_CLASS_NUM];     ///< 每种规格一个内存池
+} mslab_t;
+
+#define MSLAB_INIT(s)           mslab_init(s,0)
+
+extern int          mslab_init(mslab_t *slab, const mpool_attr_t *attr);
+extern mslab_t*     mslab_new(const mpool_attr_t *attr);
+extern int          mslab_destroy(mslab_t *slab);
+
+extern size_t       mslab_class_size(size_t cls);
+
+extern void*        mslab_malloc(mslab_t *slab, size_t size);
+extern void         mslab_free(mslab_t *slab, void *mem);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
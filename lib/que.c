@@ -8,6 +8,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -28,9 +29,267 @@ int que_init(que_cb_t *que, mpool_t *mp)
     mtx_init(&que->lock, mtx_plain | mtx_recursive);
     que->count = 0;
     que->mpool = mp;
+    que->mslab = NULL;
+    que->arena = NULL;
+    que->capacity = QUE_MAX_SIZE;
+    que->high_mark = 0;
+    que->low_mark = 0;
+    que->mark_cb = NULL;
+    que->mark_arg = NULL;
+    que->marked = false;
+    que->key_len = 0;
+    que->kidx = NULL;
+    que->kidx_mask = 0;
+    que->coalesced = 0;
     return 0;
 }
 
+/**
+ * @brief   初始化队列，元素从多规格分配器中分配
+ * @param   que     队列指针
+ *          slab    多规格分配器指针，当为NULL时，采用malloc和free
+ * @return  成功返回0，失败返回-1并设置errno
+ */
+int que_init_slab(que_cb_t *que, mslab_t *slab)
+{
+    if (que_init(que, NULL) != 0)
+        return -1;
+    que->mslab = slab;
+    return 0;
+}
+
+/**
+ * @brief   初始化队列，元素从线性分配器中分配
+ * @param   que     队列指针
+ *          arena   线性分配器指针，当为NULL时，采用malloc和free
+ * @return  成功返回0，失败返回-1并设置errno
+ *
+ * @note    删除元素时不回收内存，元素的内存随arena_reset一并回收；
+ *          适合在一次请求内创建、请求结束后整体丢弃的临时队列
+ */
+int que_init_arena(que_cb_t *que, arena_t *arena)
+{
+    if (que_init(que, NULL) != 0)
+        return -1;
+    que->arena = arena;
+    return 0;
+}
+
+/**
+ * @brief   内部函数，为队列元素分配内存
+ * @param   que     队列指针
+ *          len     元素内的数据长度
+ * @return  成功返回元素指针，失败返回NULL并设置errno
+ */
+static que_elm_t* que_elm_alloc(que_cb_t *que, size_t len)
+{
+    if (que->arena)
+        return (que_elm_t*)arena_malloc(que->arena, QUE_BLOCK_SIZE(len));
+    else if (que->mslab)
+        return (que_elm_t*)mslab_malloc(que->mslab, QUE_BLOCK_SIZE(len));
+    else if (que->mpool)
+        return (que_elm_t*)mpool_malloc(que->mpool, QUE_BLOCK_SIZE(len));
+    else
+        return (que_elm_t*)malloc(QUE_BLOCK_SIZE(len));
+}
+
+/**
+ * @brief   内部函数，释放队列元素的内存
+ * @param   que     队列指针
+ *          elm     队列元素
+ * @return  void
+ */
+static void que_elm_free(que_cb_t *que, que_elm_t *elm)
+{
+    if (que->arena)
+        return;
+    else if (que->mslab)
+        mslab_free(que->mslab, elm);
+    else if (que->mpool)
+        mpool_free(que->mpool, elm);
+    else
+        free(elm);
+}
+
+/**
+ * @brief   内部函数，修改队列长度，越过高低水位线时调用水位回调（须持有锁）
+ * @param   que     队列指针
+ *          n       增加的元素个数，负数表示减少
+ * @return  void
+ */
+static void que_count_add(que_cb_t *que, int n)
+{
+    que->count += n;
+    if (que->count < 0)
+        que->count = 0;
+    if (que->mark_cb == NULL)
+        return;
+    if (!que->marked && que->count >= que->high_mark) {
+        que->marked = true;
+        que->mark_cb(que->mark_arg, true);
+    } else if (que->marked && que->count <= que->low_mark) {
+        que->marked = false;
+        que->mark_cb(que->mark_arg, false);
+    }
+}
+
+/// 键索引的初始槽数，索引的装载率保持在1/2以下
+#define QUE_KIDX_MIN            16
+
+/**
+ * @brief   内部函数，计算键的散列值（FNV-1a）
+ * @param   que     队列指针
+ *          key     键，长度为que->key_len
+ * @return  散列值
+ */
+static size_t que_key_hash(const que_cb_t *que, const void *key)
+{
+    const unsigned char *p = (const unsigned char *)key;
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < que->key_len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return (size_t)(h ^ (h >> 32));
+}
+
+/**
+ * @brief   内部函数，在键索引中查找键（须持有锁）
+ * @param   que     队列指针
+ *          key     键
+ * @return  找到时返回该键所在槽的下标，否则返回该键应放入的空槽的下标
+ */
+static size_t que_key_slot(que_cb_t *que, const void *key)
+{
+    size_t i = que_key_hash(que, key) & que->kidx_mask;
+    while (que->kidx[i] && memcmp(que->kidx[i]->data, key, que->key_len) != 0) {
+        i = (i + 1) & que->kidx_mask;
+    }
+    return i;
+}
+
+/**
+ * @brief   内部函数，保证键索引中至少还能放入一个元素，必要时扩大一倍（须持有锁）
+ * @param   que     队列指针
+ * @return  成功返回0，失败返回-1并设置errno
+ */
+static int que_key_reserve(que_cb_t *que)
+{
+    size_t size = que->kidx ? que->kidx_mask + 1 : 0;
+    if (((size_t)que->count + 1) * 2 <= size)
+        return 0;
+
+    size_t nsize = size ? size * 2 : QUE_KIDX_MIN;
+    que_elm_t **kidx = (que_elm_t **)calloc(nsize, sizeof(que_elm_t *));
+    if (kidx == NULL)
+        return -1;
+
+    que_elm_t **old = que->kidx;
+    que->kidx = kidx;
+    que->kidx_mask = nsize - 1;
+    for (size_t i = 0; i < size; i++) {
+        if (old[i])
+            que->kidx[que_key_slot(que, old[i]->data)] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/**
+ * @brief   内部函数，把新元素加入键索引，须先调用que_key_reserve（须持有锁）
+ * @param   que     队列指针
+ *          elm     新元素
+ * @return  void
+ */
+static void que_key_add(que_cb_t *que, que_elm_t *elm)
+{
+    if (que->key_len)
+        que->kidx[que_key_slot(que, elm->data)] = elm;
+}
+
+/**
+ * @brief   内部函数，从键索引中删除元素（须持有锁）
+ * @param   que     队列指针
+ *          elm     要删除的元素
+ * @return  void
+ *
+ * @note    线性探测不使用删除标记，而是把后面探测链上的元素前移填补空槽
+ */
+static void que_key_del(que_cb_t *que, que_elm_t *elm)
+{
+    size_t i = que_key_slot(que, elm->data), j = i;
+    que->kidx[i] = NULL;
+    for (;;) {
+        j = (j + 1) & que->kidx_mask;
+        if (que->kidx[j] == NULL)
+            break;
+        size_t k = que_key_hash(que, que->kidx[j]->data) & que->kidx_mask;
+        /* the ideal slot k is not in (i, j], so the element can fill the hole */
+        if ((i < j) ? (k <= i || k > j) : (k <= i && k > j)) {
+            que->kidx[i] = que->kidx[j];
+            que->kidx[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+/**
+ * @brief   内部函数，按键合并插入的数据（须持有锁）
+ * @param   que     队列指针
+ *          data    插入的数据指针
+ *          len     插入的数据长度
+ *
+ * @return  已覆盖相同键的元素返回1；
+ *          未启用合并或队列中没有相同键的元素返回0（已为新元素预留索引槽）；
+ *          失败返回-1并设置errno
+ */
+static int que_key_coalesce(que_cb_t *que, void *data, size_t len)
+{
+    if (que->key_len == 0)
+        return 0;
+    if (len < que->key_len) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (que_key_reserve(que) != 0)
+        return -1;
+
+    size_t i = que_key_slot(que, data);
+    que_elm_t *elm = que->kidx[i];
+    if (elm == NULL)
+        return 0;
+
+    if (len > elm->len) {
+        /* the new value is longer, replace the element at the same position */
+        que_elm_t *nelm = que_elm_alloc(que, len);
+        if (nelm == NULL)
+            return -1;
+        TAILQ_INSERT_BEFORE(elm, nelm, entry);
+        TAILQ_REMOVE(&que->head, elm, entry);
+        que_elm_free(que, elm);
+        que->kidx[i] = elm = nelm;
+    }
+    memcpy(elm->data, data, len);
+    elm->len = len;
+    que->coalesced++;
+    return 1;
+}
+
+/**
+ * @brief   内部函数，从队列中删除并释放元素（须持有锁）
+ * @param   que     队列指针
+ *          elm     要删除的元素
+ * @return  void
+ */
+static void que_elm_remove(que_cb_t *que, que_elm_t *elm)
+{
+    if (que->key_len)
+        que_key_del(que, elm);
+    TAILQ_REMOVE(&que->head, elm, entry);
+    que_elm_free(que, elm);
+    que_count_add(que, -1);
+}
+
 /**
  * @brief   创建队列
  * @param   que    队列指针
@@ -54,6 +313,126 @@ que_cb_t* que_new(que_cb_t **que, mpool_t *mp)
     return newq;
 }
 
+/**
+ * @brief   创建队列，队列本身及其元素都从线性分配器中分配
+ * @param   que     队列指针
+ *          arena   线性分配器指针
+ * @return  返回新建的队列，并将该队列的指针赋给*que（如果que不为NULL的话）
+ * @retval  !NULL   成功
+ * @retval  NULL    失败并设置errno
+ *
+ * @attention   返回的队列不需要free，但在arena_reset之前仍需要que_destroy（销毁互斥锁）
+ */
+que_cb_t* que_new_arena(que_cb_t **que, arena_t *arena)
+{
+    que_cb_t *newq = NULL;
+    if (arena == NULL) {
+        errno = EINVAL;
+    } else if ((newq = (que_cb_t*)arena_malloc(arena, sizeof(que_cb_t))) != NULL) {
+        if (que_init_arena(newq, arena) < 0) {
+            newq = NULL;
+        }
+    }
+
+    if (que) {
+        *que = newq;
+    }
+    return newq;
+}
+
+/**
+ * @brief   设置队列的容量（最多容纳的元素个数）
+ * @param   que         队列指针
+ *          capacity    容量，必须大于0，默认为QUE_MAX_SIZE
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ */
+int que_set_capacity(que_cb_t *que, int capacity)
+{
+    if (que == NULL || capacity <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    mtx_lock(&que->lock);
+    que->capacity = capacity;
+    mtx_unlock(&que->lock);
+    return 0;
+}
+
+/**
+ * @brief   设置队列的高低水位线及回调
+ * @param   que     队列指针
+ *          high    高水位线，队列长度增加到high时以true调用回调
+ *          low     低水位线，越过高水位之后队列长度减少到low时以false调用回调，须小于high
+ *          cb      水位回调，NULL表示取消
+ *          arg     回调的参数
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ *
+ * @note    回调在持有队列锁时调用，应尽快返回
+ */
+int que_set_watermark(que_cb_t *que, int high, int low, que_mark_cb_t cb, void *arg)
+{
+    if (que == NULL || (cb && (low < 0 || low >= high))) {
+        errno = EINVAL;
+        return -1;
+    }
+    mtx_lock(&que->lock);
+    que->high_mark = high;
+    que->low_mark = low;
+    que->mark_cb = cb;
+    que->mark_arg = arg;
+    que->marked = false;
+    mtx_unlock(&que->lock);
+    return 0;
+}
+
+/**
+ * @brief   把队列设为按键合并的队列
+ * @param   que     队列指针
+ *          key_len 键的长度，即数据的前key_len字节；为0表示取消合并
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ *
+ * @note    只能在队列为空时设置；设置之后所有的插入都按键合并：队列中已有相同键的元素时，
+ *          就地覆盖其数据（位置不变，不检查容量），否则才新增元素；插入的数据长度不能小于key_len
+ *
+ * @par     示例
+ * @code
+ * typedef struct {
+ *     int chip;           // key
+ *     int freq;
+ *     int temp;
+ * } chip_stat_t;
+ *
+ * que_set_key(que, sizeof(int));
+ * que_insert_tail(que, &stat, sizeof(stat));  // the pending stat of the same chip is overwritten
+ * ...
+ * while (que_pop_head(que, &stat, sizeof(stat)) > 0) {
+ *     // only the latest stat of every chip
+ * }
+ * @endcode
+ */
+int que_set_key(que_cb_t *que, size_t key_len)
+{
+    if (que == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    mtx_lock(&que->lock);
+    if (!QUE_EMPTY(que)) {
+        mtx_unlock(&que->lock);
+        errno = EBUSY;
+        return -1;
+    }
+    free(que->kidx);
+    que->kidx = NULL;
+    que->kidx_mask = 0;
+    que->key_len = key_len;
+    mtx_unlock(&que->lock);
+    return 0;
+}
+
 /**
  * @brief   队列是否为空，如果参数是NULL则“队列”始终为”空“
  * @param   thrq    队列指针
@@ -106,18 +485,20 @@ int que_insert_head(que_cb_t *que, void *data, size_t len)
     }
 
     mtx_lock(&que->lock);
+    /* coalesce with the pending element of the same key */
+    int ret = que_key_coalesce(que, data, len);
+    if (ret != 0) {
+        mtx_unlock(&que->lock);
+        return ret > 0 ? 0 : -1;
+    }
     /* queue is full */
-    if (que->count >= QUE_MAX_SIZE) {
+    if (que->count >= que->capacity) {
         mtx_unlock(&que->lock);
         errno = LIB_ERRNO_QUE_FULL;
         return -1;
     }
     /* malloc */
-    que_elm_t *elm;
-    if (que->mpool)
-        elm = (que_elm_t*)mpool_malloc(que->mpool, QUE_BLOCK_SIZE(len));
-    else
-        elm = (que_elm_t*)malloc(QUE_BLOCK_SIZE(len));
+    que_elm_t *elm = que_elm_alloc(que, len);
     if (elm == 0) {
         mtx_unlock(&que->lock);
         return -1;
@@ -126,7 +507,8 @@ int que_insert_head(que_cb_t *que, void *data, size_t len)
     memcpy(elm->data, data, len);
     elm->len = len;
     TAILQ_INSERT_HEAD(&que->head, elm, entry);
-    que->count++;
+    que_key_add(que, elm);
+    que_count_add(que, 1);
 
     mtx_unlock(&que->lock);
     return 0;
@@ -148,17 +530,20 @@ int que_insert_tail(que_cb_t *que, void *data, size_t len)
     }
 
     mtx_lock(&que->lock);
+    /* coalesce with the pending element of the same key */
+    int ret = que_key_coalesce(que, data, len);
+    if (ret != 0) {
+        mtx_unlock(&que->lock);
+        return ret > 0 ? 0 : -1;
+    }
     /* queue is full */
-    if (que->count >= QUE_MAX_SIZE) {
+    if (que->count >= que->capacity) {
         mtx_unlock(&que->lock);
+        errno = LIB_ERRNO_QUE_FULL;
         return -1;
     }
     /* malloc */
-    que_elm_t *elm;
-    if (que->mpool)
-        elm = (que_elm_t*)mpool_malloc(que->mpool, QUE_BLOCK_SIZE(len));
-    else
-        elm = (que_elm_t*)malloc(QUE_BLOCK_SIZE(len));
+    que_elm_t *elm = que_elm_alloc(que, len);
     if (elm == 0) {
         mtx_unlock(&que->lock);
         return -1;
@@ -167,12 +552,42 @@ int que_insert_tail(que_cb_t *que, void *data, size_t len)
     memcpy(elm->data, data, len);
     elm->len = len;
     TAILQ_INSERT_TAIL(&que->head, elm, entry);
-    que->count++;
+    que_key_add(que, elm);
+    que_count_add(que, 1);
 
     mtx_unlock(&que->lock);
     return 0;
 }
 
+/**
+ * @brief   取出队列首的元素
+ * @param   que     队列指针
+ *          buf     接收数据的缓存
+ *          bufsize 缓存大小，小于元素的数据长度时截断
+ *
+ * @return  成功返回拷贝的数据长度，失败返回-1并设置errno（队列空时为LIB_ERRNO_QUE_EMPTY）
+ */
+int que_pop_head(que_cb_t *que, void *buf, size_t bufsize)
+{
+    if (que == NULL || buf == NULL || bufsize == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mtx_lock(&que->lock);
+    que_elm_t *elm = QUE_FIRST(que);
+    if (elm == NULL) {
+        mtx_unlock(&que->lock);
+        errno = LIB_ERRNO_QUE_EMPTY;
+        return -1;
+    }
+    size_t cpsize = (bufsize < elm->len) ? bufsize : elm->len;
+    memcpy(buf, elm->data, cpsize);
+    que_elm_remove(que, elm);
+    mtx_unlock(&que->lock);
+    return (int)cpsize;
+}
+
 /**
  * @brief   在某元素之后插入数据，非线程安全!
  * @param   que         队列
@@ -181,6 +596,8 @@ int que_insert_tail(que_cb_t *que, void *data, size_t len)
  *          len         插入的数据长度
  *
  * @return  成功返回0，失败返回-1并设置errno
+ *
+ * @note    按键合并的队列中已有相同键的元素时，覆盖该元素而不在指定位置插入
  */
 int QUE_INSERT_AFTER(que_cb_t *que, que_elm_t *list_elm, void *data, size_t len)
 {
@@ -189,22 +606,23 @@ int QUE_INSERT_AFTER(que_cb_t *que, que_elm_t *list_elm, void *data, size_t len)
         return -1;
     }
 
-    if (que->count >= QUE_MAX_SIZE) {
+    int ret = que_key_coalesce(que, data, len);
+    if (ret != 0) {
+        return ret > 0 ? 0 : -1;
+    }
+    if (que->count >= que->capacity) {
         errno = LIB_ERRNO_QUE_FULL;
         return -1;
     }
-    que_elm_t *elm;
-    if (que->mpool)
-        elm = (que_elm_t*)mpool_malloc(que->mpool, QUE_BLOCK_SIZE(len));
-    else
-        elm = (que_elm_t*)malloc(QUE_BLOCK_SIZE(len));
+    que_elm_t *elm = que_elm_alloc(que, len);
     if (elm == 0) {
         return -1;
     }
     memcpy(elm->data, data, len);
     elm->len = len;
     TAILQ_INSERT_AFTER(&que->head, list_elm, elm, entry);
-    que->count++;
+    que_key_add(que, elm);
+    que_count_add(que, 1);
 
     return 0;
 }
@@ -217,6 +635,8 @@ int QUE_INSERT_AFTER(que_cb_t *que, que_elm_t *list_elm, void *data, size_t len)
  *          len         插入的数据长度
  *
  * @return  成功返回0，失败返回-1并设置errno
+ *
+ * @note    按键合并的队列中已有相同键的元素时，覆盖该元素而不在指定位置插入
  */
 int QUE_INSERT_BEFORE(que_cb_t *que, que_elm_t *list_elm, void *data, size_t len)
 {
@@ -225,22 +645,23 @@ int QUE_INSERT_BEFORE(que_cb_t *que, que_elm_t *list_elm, void *data, size_t len
         return -1;
     }
 
-    if (que->count >= QUE_MAX_SIZE) {
+    int ret = que_key_coalesce(que, data, len);
+    if (ret != 0) {
+        return ret > 0 ? 0 : -1;
+    }
+    if (que->count >= que->capacity) {
         errno = LIB_ERRNO_QUE_FULL;
         return -1;
     }
-    que_elm_t *elm;
-    if (que->mpool)
-        elm = (que_elm_t*)mpool_malloc(que->mpool, QUE_BLOCK_SIZE(len));
-    else
-        elm = (que_elm_t*)malloc(QUE_BLOCK_SIZE(len));
+    que_elm_t *elm = que_elm_alloc(que, len);
     if (elm == 0) {
         return -1;
     }
     memcpy(elm->data, data, len);
     elm->len = len;
     TAILQ_INSERT_BEFORE(list_elm, elm, entry);
-    que->count++;
+    que_key_add(que, elm);
+    que_count_add(que, 1);
 
     return 0;
 }
@@ -254,10 +675,16 @@ void que_destroy(que_cb_t *que)
 {
     if (que) {
         mtx_lock(&que->lock);
+        que->mark_cb = NULL;
+        que->key_len = 0;
         while (!QUE_EMPTY(que)) {
             QUE_REMOVE(que, QUE_FIRST(que));
         }
+        free(que->kidx);
+        que->kidx = NULL;
         que->mpool = NULL;
+        que->mslab = NULL;
+        que->arena = NULL;
         mtx_unlock(&que->lock);
 
         mtx_destroy(&que->lock);
@@ -277,14 +704,7 @@ int QUE_REMOVE(que_cb_t *que, que_elm_t *elm)
         errno = EINVAL;
         return -1;
     }
-    TAILQ_REMOVE(&que->head, elm, entry);
-    if (que->mpool)
-        mpool_free(que->mpool, elm);
-    else
-        free(elm);
-    if (que->count > 0) {
-        que->count--;
-    }
+    que_elm_remove(que, elm);
     return 0;
 }
 
@@ -310,14 +730,7 @@ int que_remove(que_cb_t *que, void *data, size_t len, que_cmp_data_t pfn_cmp)
         mtx_unlock(&que->lock);
         return -1;
     }
-    TAILQ_REMOVE(&que->head, elm, entry);
-    if (que->mpool)
-        mpool_free(que->mpool, elm);
-    else
-        free(elm);
-    if (que->count > 0) {
-        que->count--;
-    }
+    que_elm_remove(que, elm);
     mtx_unlock(&que->lock);
     return 0;
 }
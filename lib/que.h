@@ -2,6 +2,10 @@
  * @file    que.h
  * @author  ln
  * @brief   队列或者链表
+ *
+ *          通过que_set_key可以把队列设为按键合并的队列：数据的前key_len字节为键，
+ *          插入时如果队列中已有相同键的元素尚未取走，则就地覆盖该元素的数据而不再新增元素，
+ *          消费者取到的总是每个键的最新值（元素保持在该键第一次入队时的位置）
  */
 
 #ifndef __QUEUE__
@@ -12,12 +16,14 @@
 #include "threads_c11.h"
 #include "err.h"
 #include "mpool.h"
+#include "mslab.h"
+#include "arena.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-/// 对内存的使用做限制，避免内存池在自增长模式下向系统无限申请内存
+/// 队列的默认容量，对内存的使用做限制，避免内存池在自增长模式下向系统无限申请内存
 #define QUE_MAX_SIZE            65536
 
 /**
@@ -52,13 +58,30 @@ typedef TAILQ_HEAD(__que_head, __que_elm) que_head_t;
 /// 查找队列数据时，用于比较数据的回调函数
 typedef int (*que_cmp_data_t)(const void*, const void*, size_t len);
 
+/// 水位回调，high为true表示队列长度达到高水位，false表示回落到低水位
+typedef void (*que_mark_cb_t)(void *arg, bool high);
+
 /* queue control block */
 typedef struct {
     mpool_t             *mpool;         ///< 内存池指针
+    mslab_t             *mslab;         ///< 多规格分配器指针，不为NULL时优先于mpool
+    arena_t             *arena;         ///< 线性分配器指针，不为NULL时优先于mslab和mpool
 
     que_head_t          head;           ///< 数据队列
     mtx_t               lock;           ///< 互斥锁
     int                 count;          ///< 当前队列里的元素个数
+    int                 capacity;       ///< 容量，默认为QUE_MAX_SIZE
+
+    int                 high_mark;      ///< 高水位线
+    int                 low_mark;       ///< 低水位线
+    que_mark_cb_t       mark_cb;        ///< 水位回调，NULL表示未启用
+    void                *mark_arg;      ///< 水位回调的参数
+    bool                marked;         ///< 是否处于高水位（已调用高水位回调而尚未回落）
+
+    size_t              key_len;        ///< 键的长度（数据的前key_len字节），为0表示不合并
+    que_elm_t           **kidx;         ///< 键索引，开放定址的散列表，按键查找尚未取走的元素
+    size_t              kidx_mask;      ///< 键索引的槽数 - 1
+    size_t              coalesced;      ///< 被合并（覆盖）的插入次数
 } que_cb_t;
 
 /// 队列是否空，非线程安全!
@@ -110,17 +133,26 @@ typedef struct {
 
 #define QUE_INIT(q)             que_init(q,0)
 #define QUE_INIT_MP(q,m)        que_init(q,m)
+#define QUE_INIT_SLAB(q,s)      que_init_slab(q,s)
+#define QUE_INIT_ARENA(q,a)     que_init_arena(q,a)
 
 /* thread safe */
 extern int          que_init(que_cb_t *que, mpool_t *mp);
+extern int          que_init_slab(que_cb_t *que, mslab_t *slab);
+extern int          que_init_arena(que_cb_t *que, arena_t *arena);
 extern que_cb_t*    que_new(que_cb_t **que, mpool_t *mp);
+extern que_cb_t*    que_new_arena(que_cb_t **que, arena_t *arena);
 extern void         que_destroy(que_cb_t *que);
+extern int          que_set_capacity(que_cb_t *que, int capacity);
+extern int          que_set_watermark(que_cb_t *que, int high, int low, que_mark_cb_t cb, void *arg);
+extern int          que_set_key(que_cb_t *que, size_t key_len);
 
 extern bool         que_empty(que_cb_t *que);
 extern int          que_count(que_cb_t *que);
 
 extern int          que_insert_head(que_cb_t *que, void *data, size_t len);
 extern int          que_insert_tail(que_cb_t *que, void *data, size_t len);
+extern int          que_pop_head(que_cb_t *que, void *buf, size_t bufsize);
 
 extern int          que_remove(que_cb_t *que, void *data, size_t len, que_cmp_data_t pfn_cmp);
 
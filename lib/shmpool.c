@@ -0,0 +1,354 @@
+/**
+ * @file    shmpool.c
+ * @author  ln
+ * @brief   共享内存池，提供进程间共享的固定大小内存块的分配与释放\n
+ *
+ *          内存池整体位于一块共享内存(shm_open或memfd)中，各进程映射的地址可以不同，
+ *          所以块与块之间使用块序号而不是指针相连；空闲块构成一个进程间共享的无锁栈，
+ *          分配与释放各只需一次CAS，不需要任何进程间的锁
+ *
+ *          进程之间通过块的偏移（shmpool_offset/shmpool_ptr）交换数据，而不需要拷贝
+ *
+ *          使用时由一个进程创建shmpool_create，其他进程通过名字shmpool_open（或通过继承/传递的fd shmpool_attach）
+ *          映射同一个内存池，之后便可以进行“分配”shmpool_malloc与“释放”shmpool_free
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "shmpool.h"
+#include "err.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// 长度按a对齐（a必须是2的幂）
+#define SHMPOOL_ALIGN_UP(len, a)        (((len) + ((a)-1)) & ~((size_t)(a)-1))
+
+/// 栈顶值中的块序号+1
+#define SHMPOOL_TOP_IDX(top)            ((uint32_t)(top))
+/// 用块序号+1和上一个栈顶值的计数构造新的栈顶值
+#define SHMPOOL_TOP_PACK(idx, top)      ((((top) >> 32) + 1) << 32 | (uint64_t)(idx))
+
+/// 块序号+1所对应的块地址
+#define SHMPOOL_BLOCK(hdr, idx) \
+    ((char *)(hdr) + (hdr)->block_off + ((size_t)(idx) - 1) * (hdr)->block_size)
+/// 空闲块的第一个字存放下一个空闲块的序号+1
+#define SHMPOOL_NEXT(blk)               ((uint32_t *)(blk))
+
+/**
+ * @brief   内部函数，检查共享内存头中的块布局是否完全位于共享内存之内
+ * @param   hdr     共享内存头，hdr->size已与共享内存的实际大小比较过
+ *
+ * @return  合法返回true，否则返回false
+ */
+static bool shmpool_hdr_valid(const shmpool_hdr_t *hdr)
+{
+    if (hdr->block_num == 0 || hdr->data_size == 0 ||
+        hdr->block_size < sizeof(uint32_t) || hdr->block_size % SHMPOOL_ALIGN != 0 ||
+        hdr->data_size > hdr->block_size ||
+        hdr->block_off < sizeof(shmpool_hdr_t) || hdr->block_off % SHMPOOL_ALIGN != 0 ||
+        hdr->block_off >= hdr->size)
+        return false;
+    /* block_off + block_num * block_size <= size, without overflow */
+    if (hdr->block_num > (hdr->size - hdr->block_off) / hdr->block_size)
+        return false;
+    return SHMPOOL_TOP_IDX(__atomic_load_n(&hdr->top, __ATOMIC_RELAXED)) <= hdr->block_num;
+}
+
+/**
+ * @brief   内部函数，映射共享内存并检查共享内存头
+ * @param   sp      共享内存池对象
+ *          fd      共享内存的文件描述符
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ */
+static int shmpool_map(shmpool_t *sp, int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return -1;
+    if ((size_t)st.st_size < sizeof(shmpool_hdr_t)) {
+        errno = EAGAIN;     // the creator has not ftruncated it yet
+        return -1;
+    }
+
+    void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        return -1;
+
+    shmpool_hdr_t *hdr = (shmpool_hdr_t *)p;
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHMPOOL_MAGIC ||
+        hdr->size != (uint64_t)st.st_size) {
+        munmap(p, st.st_size);
+        errno = EAGAIN;     // not a pool, or the creator is still initializing it
+        return -1;
+    }
+    if (!shmpool_hdr_valid(hdr)) {
+        munmap(p, st.st_size);
+        errno = EINVAL;     // truncated or foreign segment, blocks would lie outside the mapping
+        return -1;
+    }
+    sp->hdr = hdr;
+    sp->size = st.st_size;
+    sp->fd = fd;
+    return 0;
+}
+
+/**
+ * @brief   创建共享内存池
+ *
+ * @param   sp          共享内存池对象
+ *          name        共享内存的名字（如"/udp_pkt"），NULL表示创建匿名共享内存(memfd)，
+ *                      此时只能通过fork继承或者unix socket传递sp->fd给其他进程
+ *          data_size   块内有效数据的大小，至少为4字节
+ *          n           块数
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ *
+ * @note    同名的共享内存已存在时失败(EEXIST)，可以先调用shmpool_unlink删除
+ */
+int shmpool_create(shmpool_t *sp, const char *name, size_t data_size, size_t n)
+{
+    if (sp == NULL || data_size == 0 || n == 0 || n >= UINT32_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t block_size = SHMPOOL_ALIGN_UP(data_size < sizeof(uint32_t) ? sizeof(uint32_t) : data_size,
+                                         SHMPOOL_ALIGN);
+    size_t block_off = SHMPOOL_ALIGN_UP(sizeof(shmpool_hdr_t), 64);
+    if (block_size < data_size || n > (SIZE_MAX - block_off) / block_size) {
+        errno = EINVAL;     // the segment size would overflow
+        return -1;
+    }
+    size_t size = block_off + n * block_size;
+
+    int fd;
+    if (name)
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    else
+        fd = (int)syscall(SYS_memfd_create, "shmpool", 0);
+    if (fd < 0)
+        return -1;
+
+    void *p = MAP_FAILED;
+    if (ftruncate(fd, size) != 0 ||
+        (p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        int ec = errno;
+        close(fd);
+        if (name)
+            shm_unlink(name);
+        errno = ec;
+        return -1;
+    }
+
+    shmpool_hdr_t *hdr = (shmpool_hdr_t *)p;
+    hdr->block_num = (uint32_t)n;
+    hdr->size = size;
+    hdr->data_size = data_size;
+    hdr->block_size = block_size;
+    hdr->block_off = block_off;
+    for (uint32_t i=1; i<=n; i++) {
+        *SHMPOOL_NEXT(SHMPOOL_BLOCK(hdr, i)) = (i < n) ? i + 1 : 0;
+    }
+    hdr->top = 1;
+    __atomic_store_n(&hdr->magic, SHMPOOL_MAGIC, __ATOMIC_RELEASE);
+
+    sp->hdr = hdr;
+    sp->size = size;
+    sp->fd = fd;
+    return 0;
+}
+
+/**
+ * @brief   通过名字映射其他进程创建的共享内存池
+ * @param   sp      共享内存池对象
+ *          name    共享内存的名字
+ *
+ * @return  成功返回0，失败返回-1并设置errno；创建者尚未初始化完成时errno为EAGAIN，
+ *          共享内存头中的块布局超出共享内存（被截断或不是本模块创建的共享内存）时为EINVAL
+ */
+int shmpool_open(shmpool_t *sp, const char *name)
+{
+    if (sp == NULL || name == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return -1;
+    if (shmpool_map(sp, fd) != 0) {
+        int ec = errno;
+        close(fd);
+        errno = ec;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief   通过文件描述符映射其他进程创建的共享内存池（例如从unix socket收到的memfd）
+ * @param   sp      共享内存池对象
+ *          fd      共享内存的文件描述符，成功后由sp持有，shmpool_close时关闭
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ */
+int shmpool_attach(shmpool_t *sp, int fd)
+{
+    if (sp == NULL || fd < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return shmpool_map(sp, fd);
+}
+
+/**
+ * @brief   解除本进程对共享内存池的映射，不影响其他进程
+ * @param   sp      共享内存池对象
+ * @return  成功返回0，失败返回-1并设置errno
+ */
+int shmpool_close(shmpool_t *sp)
+{
+    if (sp == NULL || sp->hdr == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    munmap(sp->hdr, sp->size);
+    close(sp->fd);
+    sp->hdr = NULL;
+    sp->size = 0;
+    sp->fd = -1;
+    return 0;
+}
+
+/**
+ * @brief   删除共享内存的名字，已映射的进程仍可继续使用，直到全部shmpool_close
+ * @param   name    共享内存的名字
+ * @return  成功返回0，失败返回-1并设置errno
+ */
+int shmpool_unlink(const char *name)
+{
+    if (name == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return shm_unlink(name);
+}
+
+/**
+ * @brief   从共享内存池中分配一个块
+ * @param   sp      共享内存池对象
+ *
+ * @return  成功返回块的有效数据指针（仅在本进程内有效），失败返回NULL并设置errno
+ *
+ * @note    块被其他进程抢先弹出时，读到的next可能已失效，但此时栈顶计数已改变，CAS必然失败
+ */
+void* shmpool_malloc(shmpool_t *sp)
+{
+    if (sp == NULL || sp->hdr == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    shmpool_hdr_t *hdr = sp->hdr;
+    uint64_t top = __atomic_load_n(&hdr->top, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint32_t idx = SHMPOOL_TOP_IDX(top);
+        if (idx == 0) {
+            errno = LIB_ERRNO_SHORT_MPOOL;
+            return NULL;
+        }
+        char *blk = SHMPOOL_BLOCK(hdr, idx);
+        uint32_t next = __atomic_load_n(SHMPOOL_NEXT(blk), __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&hdr->top, &top, SHMPOOL_TOP_PACK(next, top),
+                                        1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+            return blk;
+    }
+}
+
+/**
+ * @brief   向共享内存池中释放一个块，块可以由任意进程分配
+ * @param   sp      共享内存池对象
+ *          mem     块的有效数据指针（本进程内的地址）
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ *
+ * @note    空闲栈由所有进程共享，一个错误的指针会破坏所有进程的内存池，所以mem不在块区内、
+ *          不在块的边界上，或者就是栈顶的块（紧接着的重复释放）时不释放，errno为EINVAL
+ */
+int shmpool_free(shmpool_t *sp, void *mem)
+{
+    if (sp == NULL || sp->hdr == NULL || mem == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    shmpool_hdr_t *hdr = sp->hdr;
+    size_t off = (char *)mem - (char *)hdr;
+    if ((char *)mem < (char *)hdr || off < hdr->block_off ||
+        (off - hdr->block_off) % hdr->block_size != 0 ||
+        (off - hdr->block_off) / hdr->block_size >= hdr->block_num) {
+        errno = EINVAL;
+        return -1;
+    }
+    uint32_t idx = (uint32_t)((off - hdr->block_off) / hdr->block_size) + 1;
+    uint64_t top = __atomic_load_n(&hdr->top, __ATOMIC_RELAXED);
+    do {
+        if (SHMPOOL_TOP_IDX(top) == idx) {
+            errno = EINVAL;     // double free
+            return -1;
+        }
+        __atomic_store_n(SHMPOOL_NEXT(mem), SHMPOOL_TOP_IDX(top), __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&hdr->top, &top, SHMPOOL_TOP_PACK(idx, top),
+                                          1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return 0;
+}
+
+/**
+ * @brief   获取块相对共享内存起始处的偏移，偏移在所有进程中都有效
+ * @param   sp      共享内存池对象
+ *          mem     块的有效数据指针（本进程内的地址）
+ *
+ * @return  成功返回偏移，mem不在共享内存池内时返回SHMPOOL_OFF_NULL
+ */
+size_t shmpool_offset(shmpool_t *sp, const void *mem)
+{
+    if (sp == NULL || sp->hdr == NULL || mem == NULL)
+        return SHMPOOL_OFF_NULL;
+
+    size_t off = (const char *)mem - (const char *)sp->hdr;
+    if (off < sp->hdr->block_off || off >= sp->size)
+        return SHMPOOL_OFF_NULL;
+    return off;
+}
+
+/**
+ * @brief   把其他进程传来的偏移转换为本进程内的地址
+ * @param   sp      共享内存池对象
+ *          off     shmpool_offset返回的偏移
+ *
+ * @return  成功返回本进程内的地址，偏移无效时返回NULL
+ */
+void* shmpool_ptr(shmpool_t *sp, size_t off)
+{
+    if (sp == NULL || sp->hdr == NULL || off < sp->hdr->block_off || off >= sp->size)
+        return NULL;
+    return (char *)sp->hdr + off;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,67 @@
+/**
+ * @file    shmpool.h
+ * @author  ln
+ * @brief   共享内存池，提供进程间共享的固定大小内存块的分配与释放\n
+ *
+ *          内存池整体位于一块共享内存(shm_open或memfd)中，各进程映射的地址可以不同，
+ *          所以块与块之间使用块序号而不是指针相连；空闲块构成一个进程间共享的无锁栈，
+ *          分配与释放各只需一次CAS，不需要任何进程间的锁
+ *
+ *          进程之间通过块的偏移（shmpool_offset/shmpool_ptr）交换数据，而不需要拷贝
+ *
+ *          使用时由一个进程创建shmpool_create，其他进程通过名字shmpool_open（或通过继承/传递的fd shmpool_attach）
+ *          映射同一个内存池，之后便可以进行“分配”shmpool_malloc与“释放”shmpool_free
+ */
+
+#ifndef __SHM_POOL__
+#define __SHM_POOL__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// 共享内存池的标识
+#define SHMPOOL_MAGIC           0x53484d50      // "SHMP"
+/// 块大小按此对齐
+#define SHMPOOL_ALIGN           8
+/// 空偏移，表示无效块
+#define SHMPOOL_OFF_NULL        ((size_t)0)
+
+/// 共享内存头，位于共享内存的起始处
+typedef struct {
+    uint32_t        magic;      ///< SHMPOOL_MAGIC，创建者初始化完成后才写入
+    uint32_t        block_num;  ///< 块数
+    uint64_t        size;       ///< 共享内存的总大小
+    uint64_t        data_size;  ///< 块内有效数据的大小
+    uint64_t        block_size; ///< 块大小（对齐后）
+    uint64_t        block_off;  ///< 第一个块相对共享内存起始处的偏移
+    uint64_t        top;        ///< 空闲栈的栈顶：高32位为ABA计数，低32位为块序号+1（0表示栈空）
+} shmpool_hdr_t;
+
+/// 进程内的共享内存池对象
+typedef struct {
+    shmpool_hdr_t   *hdr;       ///< 共享内存的映射地址（即共享内存头）
+    size_t          size;       ///< 映射的大小
+    int             fd;         ///< 共享内存的文件描述符
+} shmpool_t;
+
+extern int          shmpool_create(shmpool_t *sp, const char *name, size_t data_size, size_t n);
+extern int          shmpool_open(shmpool_t *sp, const char *name);
+extern int          shmpool_attach(shmpool_t *sp, int fd);
+extern int          shmpool_close(shmpool_t *sp);
+extern int          shmpool_unlink(const char *name);
+
+extern void*        shmpool_malloc(shmpool_t *sp);
+extern int          shmpool_free(shmpool_t *sp, void *mem);
+
+extern size_t       shmpool_offset(shmpool_t *sp, const void *mem);
+extern void*        shmpool_ptr(shmpool_t *sp, size_t off);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -5,14 +5,51 @@
  */
 
 #include "thrq.h"
+#include "timetick.h"
+#include <stddef.h>
 #include <string.h>
+#include <stdlib.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define THRQ_EMPTY(thrq)        TAILQ_EMPTY(&thrq->head)
-#define THRQ_FIRST(thrq)        TAILQ_FIRST(&thrq->head)
+/// 最高的非空优先级通道（队列不能为空）
+#define THRQ_TOP_PRIO(thrq)     (31 - __builtin_clz((thrq)->prio_mask))
+#define THRQ_EMPTY(thrq)        ((thrq)->prio_mask == 0)
+#define THRQ_FIRST(thrq)        TAILQ_FIRST(&(thrq)->head[THRQ_TOP_PRIO(thrq)])
+
+/// 环形队列中位置pos所对应的槽
+#define THRQ_RING_SLOT(ring, pos)   ((thrq_slot_t *)((ring)->slots + ((pos) & (ring)->mask) * (ring)->stride))
+/// 槽数据区所在的槽
+#define THRQ_DATA_SLOT(data)        ((thrq_slot_t *)((unsigned char *)(data) - offsetof(thrq_slot_t, data)))
+/// 元素数据区所在的元素
+#define THRQ_DATA_ELM(data)         ((thrq_elm_t *)((unsigned char *)(data) - offsetof(thrq_elm_t, data)))
+/// elm->len的最高位，表示元素前面带有入队时刻
+#define THRQ_ELM_STAMPED            (~(SIZE_MAX >> 1))
+/// 元素内的数据长度
+#define THRQ_ELM_LEN(elm)           ((elm)->len & ~THRQ_ELM_STAMPED)
+/// 元素前面的入队时刻（须带有THRQ_ELM_STAMPED）
+#define THRQ_ELM_STAMP(elm)         (((uint64_t *)(elm))[-1])
+
+/// 自适应自旋的最小次数
+#define THRQ_SPIN_MIN               64
+
+/// 自旋等待时提示CPU降低功耗、让出流水线给同核的其他超线程
+#if defined(__x86_64__) || defined(__i386__)
+#define THRQ_CPU_RELAX()            __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define THRQ_CPU_RELAX()            __asm__ __volatile__("yield" ::: "memory")
+#else
+#define THRQ_CPU_RELAX()            __asm__ __volatile__("" ::: "memory")
+#endif
 
 /**
  * @brief   初始化线程队列
@@ -27,303 +64,2037 @@ int thrq_init(thrq_cb_t *thrq, mpool_t *mp)
         errno = EINVAL;
         return -1;
     }
-
-    TAILQ_INIT(&thrq->head);
-    if (mtx_init(&thrq->lock, mtx_plain | mtx_recursive) == thrd_error)
-        return -1;    
-    if (cnd_init(&thrq->cond) == thrd_error) 
-        return -1;
-
-    thrq->count = 0;
-    thrq->mpool = mp;
-
+
+    for (int i=0; i<THRQ_PRIO_NUM; i++)
+        TAILQ_INIT(&thrq->head[i]);
+    thrq->prio_mask = 0;
+    if (mtx_init(&thrq->lock, mtx_plain | mtx_recursive) == thrd_error)
+        return -1;    
+    if (cnd_init(&thrq->cond) == thrd_error) 
+        return -1;
+    if (cnd_init(&thrq->space) == thrd_error) {
+        cnd_destroy(&thrq->cond);
+        return -1;
+    }
+
+    thrq->count = 0;
+    thrq->mpool = mp;
+    thrq->mslab = NULL;
+    thrq->arena = NULL;
+    thrq->mode = THRQ_MODE_LIST;
+    thrq->ring = NULL;
+    thrq->efd = -1;
+    thrq->efd_armed = 0;
+    thrq->spin = 0;
+    thrq->spin_avg = 0;
+    thrq->nwait = 0;
+    thrq->capacity = THRQ_MAX_SIZE;
+    thrq->nwait_send = 0;
+    thrq->reserved = 0;
+    thrq->high_mark = 0;
+    thrq->low_mark = 0;
+    thrq->mark_cb = NULL;
+    thrq->mark_arg = NULL;
+    thrq->marked = 0;
+    thrq->mark_busy = 0;
+    thrq->hist = NULL;
+    thrq->hist_on = 0;
+
+    return 0;
+}
+
+/**
+ * @brief   初始化线程队列，元素从多规格分配器中分配
+ * @param   thrq    线程队列
+ * @param   slab    多规格分配器指针，当为NULL时，采用malloc和free
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ *
+ * @note    不同长度的消息各自从最接近的规格中分配，不需要按最大消息长度预留固定块
+ */
+int thrq_init_slab(thrq_cb_t *thrq, mslab_t *slab)
+{
+    if (thrq_init(thrq, NULL) != 0)
+        return -1;
+    thrq->mslab = slab;
+    return 0;
+}
+
+/**
+ * @brief   初始化线程队列，元素从线性分配器中分配
+ * @param   thrq    线程队列
+ * @param   arena   线性分配器指针，当为NULL时，采用malloc和free
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ *
+ * @note    分配在队列锁内进行，所以多个发送线程可以共用同一个队列；
+ *          收取消息时不回收内存，消息的内存随arena_reset一并回收
+ *
+ * @attention   arena_reset/arena_rewind必须在没有线程收发该队列时进行，且不能与其他对象共用该arena
+ */
+int thrq_init_arena(thrq_cb_t *thrq, arena_t *arena)
+{
+    if (thrq_init(thrq, NULL) != 0)
+        return -1;
+    thrq->arena = arena;
+    return 0;
+}
+
+/**
+ * @brief   内部函数，创建环形队列
+ * @param   slot_size   每个槽可容纳的最大数据长度
+ *          nslots      槽数，向上取为2的幂
+ *
+ * @return  成功返回环形队列，失败返回NULL并设置errno
+ */
+static thrq_ring_t* thrq_ring_new(size_t slot_size, size_t nslots)
+{
+    if (slot_size == 0 || nslots == 0 || nslots > ((size_t)1 << (sizeof(size_t) * 8 - 2))) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t n = 1;
+    while (n < nslots) {
+        n <<= 1;
+    }
+    size_t stride = (sizeof(thrq_slot_t) + slot_size + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+    size_t hdr = (sizeof(thrq_ring_t) + THRQ_CACHELINE - 1) & ~((size_t)THRQ_CACHELINE - 1);
+    size_t size = (hdr + n * stride + THRQ_CACHELINE - 1) & ~((size_t)THRQ_CACHELINE - 1);
+
+    thrq_ring_t *ring = (thrq_ring_t *)aligned_alloc(THRQ_CACHELINE, size);
+    if (ring == NULL)
+        return NULL;
+    memset(ring, 0, sizeof(thrq_ring_t));
+    ring->mask = n - 1;
+    ring->slot_size = slot_size;
+    ring->stride = stride;
+    ring->slots = (unsigned char *)ring + hdr;
+    for (size_t i=0; i<n; i++) {
+        THRQ_RING_SLOT(ring, i)->seq = i;
+    }
+    return ring;
+}
+
+/**
+ * @brief   内部函数，在等待字上休眠，直到等待字不等于val、被唤醒或者超时
+ * @param   addr        等待字
+ *          val         调用者读取到的等待字的值
+ *          deadline    超时的时刻（monotime），0表示一直等待
+ *
+ * @return  超时返回thrd_timeout，否则返回thrd_success（可能是虚假唤醒，调用者需重新检查条件）
+ */
+static int thrq_futex_wait(uint32_t *addr, uint32_t val, double deadline)
+{
+    struct timespec ts, *pts = NULL;
+    if (deadline > 0) {
+        double left = deadline - monotime();
+        if (left <= 0)
+            return thrd_timeout;
+        DOUBLE2SPEC(ts, left);
+        pts = &ts;
+    }
+#ifdef __linux__
+    if (syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, pts, NULL, 0) == -1 && errno == ETIMEDOUT)
+        return thrd_timeout;
+#else
+    (void)addr; (void)val; (void)pts;
+    thrd_yield();
+#endif
+    return thrd_success;
+}
+
+/**
+ * @brief   内部函数，环形队列的读写位置改变后，唤醒一个方向上的等待者（没有等待者时不进行系统调用）
+ * @param   ring    环形队列
+ *          writer  true表示唤醒等空槽的发送方（归还之后），false表示唤醒等数据的接收方（提交之后）
+ *          n       新增的消息或空槽个数，最多唤醒n个等待者
+ * @return  void
+ *
+ * @note    位置的写入与nwait的读取之间需要全屏障，与等待者“nwait加1、再检查位置”的顺序相对应；
+ *          收发两端各用一个等待字，一个槽只唤醒一个线程，被唤醒却没抢到槽的线程会重新休眠
+ */
+static void thrq_ring_wake(thrq_ring_t *ring, bool writer, int n)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->nwait[writer], __ATOMIC_RELAXED) == 0)
+        return;
+    __atomic_fetch_add(&ring->futex[writer], 1, __ATOMIC_RELEASE);
+#ifdef __linux__
+    syscall(SYS_futex, &ring->futex[writer], FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+#endif
+}
+
+/**
+ * @brief   内部函数，单生产者单消费者模式下的写入位置是否有空槽
+ */
+static bool thrq_spsc_writable(thrq_ring_t *ring, size_t tail)
+{
+    if (tail - ring->head_cache <= ring->mask)
+        return true;
+    ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    return tail - ring->head_cache <= ring->mask;
+}
+
+/**
+ * @brief   内部函数，单生产者单消费者模式下的读取位置是否有数据
+ */
+static bool thrq_spsc_readable(thrq_ring_t *ring, size_t head)
+{
+    if (head != ring->tail_cache)
+        return true;
+    ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    return head != ring->tail_cache;
+}
+
+/**
+ * @brief   内部函数，多生产者多消费者模式下队列是否有空槽
+ * @note    写入位置上的槽序号等于写入位置时，槽为空；小于时队列已满
+ */
+static bool thrq_mpmc_writable(thrq_ring_t *ring)
+{
+    size_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    size_t seq = __atomic_load_n(&THRQ_RING_SLOT(ring, pos)->seq, __ATOMIC_ACQUIRE);
+    return (intptr_t)(seq - pos) >= 0;
+}
+
+/**
+ * @brief   内部函数，多生产者多消费者模式下队列是否有数据
+ * @note    读取位置上的槽序号等于读取位置+1时，槽中有数据；小于时队列为空
+ */
+static bool thrq_mpmc_readable(thrq_ring_t *ring)
+{
+    size_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    size_t seq = __atomic_load_n(&THRQ_RING_SLOT(ring, pos)->seq, __ATOMIC_ACQUIRE);
+    return (intptr_t)(seq - (pos + 1)) >= 0;
+}
+
+/**
+ * @brief   内部函数，队列中是否有可接收的消息，不加锁（环形队列模式下只能由消费者调用）
+ */
+static bool thrq_readable(thrq_cb_t *thrq)
+{
+    thrq_ring_t *ring = thrq->ring;
+    if (ring)
+        return (thrq->mode == THRQ_MODE_SPSC) ? thrq_spsc_readable(ring, ring->head) : thrq_mpmc_readable(ring);
+    return __atomic_load_n(&thrq->count, __ATOMIC_ACQUIRE) > 0;
+}
+
+/**
+ * @brief   内部函数，接收方休眠之前自旋等待消息
+ * @param   thrq    线程队列指针
+ *
+ * @return  自旋期间有消息到达返回true，否则返回false（调用者应休眠）
+ *
+ * @note    自适应模式下，自旋次数上限为最近成功自旋次数平均值的2倍再加THRQ_SPIN_MIN（不超过THRQ_SPIN_MAX）；
+ *          成功时平均值向本次自旋次数靠拢1/8，失败时平均值衰减1/8，所以消息间隔较长时自旋很快缩短到THRQ_SPIN_MIN
+ */
+static bool thrq_spin(thrq_cb_t *thrq)
+{
+    int spin = thrq->spin;
+    int avg = 0;
+    if (spin == 0)
+        return false;
+    if (spin == THRQ_SPIN_ADAPTIVE) {
+        avg = __atomic_load_n(&thrq->spin_avg, __ATOMIC_RELAXED);
+        spin = 2 * avg + THRQ_SPIN_MIN;
+        if (spin > THRQ_SPIN_MAX)
+            spin = THRQ_SPIN_MAX;
+    }
+
+    for (int i=1; i<=spin; i++) {
+        THRQ_CPU_RELAX();
+        if (thrq_readable(thrq)) {
+            if (thrq->spin == THRQ_SPIN_ADAPTIVE)
+                __atomic_store_n(&thrq->spin_avg, avg + (i - avg) / 8, __ATOMIC_RELAXED);
+            return true;
+        }
+    }
+    if (thrq->spin == THRQ_SPIN_ADAPTIVE)
+        __atomic_store_n(&thrq->spin_avg, avg - avg / 8, __ATOMIC_RELAXED);
+    return false;
+}
+
+/**
+ * @brief   设置接收方在队列空时休眠之前的自旋策略
+ * @param   thrq    线程队列指针
+ *          spin    0表示不自旋（默认），直接休眠；大于0表示固定的自旋次数；
+ *                  THRQ_SPIN_ADAPTIVE表示根据最近的消息间隔自动调整自旋次数
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ *
+ * @note    消息间隔很短（微秒级）时，自旋可以省去接收方休眠和发送方唤醒的两次futex系统调用；
+ *          只有一个CPU时自旋没有意义（发送方在自旋结束之前得不到运行），此时THRQ_SPIN_ADAPTIVE等同于0
+ */
+int thrq_set_spin(thrq_cb_t *thrq, int spin)
+{
+    if (thrq == NULL || spin < THRQ_SPIN_ADAPTIVE) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (spin == THRQ_SPIN_ADAPTIVE && sysconf(_SC_NPROCESSORS_ONLN) <= 1)
+        spin = 0;
+    thrq->spin_avg = 0;
+    __atomic_store_n(&thrq->spin, spin, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * @brief   内部函数，单调时钟的当前时刻
+ * @return  纳秒
+ */
+static uint64_t thrq_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief   内部函数，打开统计时返回队列的直方图
+ * @param   thrq    线程队列指针
+ * @return  打开统计时返回直方图，否则返回NULL
+ */
+static thrq_hist_t* thrq_hist(thrq_cb_t *thrq)
+{
+    if (!__atomic_load_n(&thrq->hist_on, __ATOMIC_RELAXED))
+        return NULL;
+    return __atomic_load_n(&thrq->hist, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief   内部函数，发送时为消息取时间戳
+ * @param   thrq    线程队列指针
+ * @return  打开统计时返回当前时刻，否则返回0
+ */
+static uint64_t thrq_stamp(thrq_cb_t *thrq)
+{
+    return __atomic_load_n(&thrq->hist_on, __ATOMIC_RELAXED) ? thrq_now_ns() : 0;
+}
+
+/**
+ * @brief   内部函数，排队时间所在的直方图桶
+ * @param   ns  排队时间（纳秒）
+ * @return  桶的下标
+ *
+ * @note    小于THRQ_HIST_SUB的值每个值一个桶；之后每个[2^e, 2^(e+1))区间等分为THRQ_HIST_SUB个桶
+ */
+static int thrq_hist_index(uint64_t ns)
+{
+    if (ns < THRQ_HIST_SUB)
+        return (int)ns;
+    int e = 63 - __builtin_clzll(ns);
+    int shift = e - THRQ_HIST_SUB_BITS;
+    return ((shift + 1) << THRQ_HIST_SUB_BITS) + (int)((ns >> shift) & (THRQ_HIST_SUB - 1));
+}
+
+/**
+ * @brief   内部函数，直方图桶所覆盖的最大值
+ * @param   idx 桶的下标
+ * @return  纳秒
+ */
+static uint64_t thrq_hist_value(int idx)
+{
+    if (idx < THRQ_HIST_SUB)
+        return (uint64_t)idx;
+    int shift = (idx >> THRQ_HIST_SUB_BITS) - 1;
+    uint64_t low = (uint64_t)(THRQ_HIST_SUB + (idx & (THRQ_HIST_SUB - 1))) << shift;
+    return low + ((1ULL << shift) - 1);
+}
+
+/**
+ * @brief   内部函数，原子地把*addr增大到val
+ * @return  void
+ */
+static void thrq_atomic_max(uint64_t *addr, uint64_t val)
+{
+    uint64_t cur = __atomic_load_n(addr, __ATOMIC_RELAXED);
+    while (val > cur &&
+           !__atomic_compare_exchange_n(addr, &cur, val, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/**
+ * @brief   内部函数，接收时记录消息的排队时间
+ * @param   thrq    线程队列指针
+ *          stamp   消息的入队时刻，为0时（发送时未打开统计）不记录
+ * @return  void
+ */
+static void thrq_hist_record(thrq_cb_t *thrq, uint64_t stamp)
+{
+    thrq_hist_t *hist = thrq_hist(thrq);
+    if (hist == NULL || stamp == 0)
+        return;
+    uint64_t now = thrq_now_ns();
+    uint64_t ns = (now > stamp) ? now - stamp : 0;
+    __atomic_fetch_add(&hist->bucket[thrq_hist_index(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum, ns, __ATOMIC_RELAXED);
+    thrq_atomic_max(&hist->max, ns);
+}
+
+/**
+ * @brief   内部函数，发送之后记录队列长度的最高水位
+ * @param   thrq    线程队列指针
+ *          depth   发送之后的队列长度
+ * @return  void
+ */
+static void thrq_hist_depth(thrq_cb_t *thrq, int depth)
+{
+    thrq_hist_t *hist = thrq_hist(thrq);
+    if (hist == NULL)
+        return;
+    int cur = __atomic_load_n(&hist->depth_max, __ATOMIC_RELAXED);
+    while (depth > cur &&
+           !__atomic_compare_exchange_n(&hist->depth_max, &cur, depth, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/**
+ * @brief   内部函数，环形队列满或空时在等待字上休眠一次
+ * @param   thrq        线程队列指针
+ *          writer      true表示等待空槽（发送方），false表示等待数据（接收方）
+ *          deadline    超时的时刻（monotime），0表示一直等待
+ *
+ * @return  超时且条件仍不满足时返回thrd_timeout，否则返回thrd_success（调用者需重新检查条件）
+ */
+static int thrq_ring_park(thrq_cb_t *thrq, bool writer, double deadline)
+{
+    thrq_ring_t *ring = thrq->ring;
+    bool spsc = (thrq->mode == THRQ_MODE_SPSC);
+#define THRQ_RING_READY() \
+    (writer ? (spsc ? thrq_spsc_writable(ring, ring->tail) : thrq_mpmc_writable(ring)) \
+            : (spsc ? thrq_spsc_readable(ring, ring->head) : thrq_mpmc_readable(ring)))
+
+    int res = thrd_success;
+    uint32_t seq = __atomic_load_n(&ring->futex[writer], __ATOMIC_ACQUIRE);
+    __atomic_fetch_add(&ring->nwait[writer], 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!THRQ_RING_READY())
+        res = thrq_futex_wait(&ring->futex[writer], seq, deadline);
+    __atomic_fetch_sub(&ring->nwait[writer], 1, __ATOMIC_RELAXED);
+    if (res == thrd_timeout && THRQ_RING_READY())
+        res = thrd_success;
+    return res;
+#undef THRQ_RING_READY
+}
+
+/**
+ * @brief   内部函数，在环形队列中预留一个槽用于写入
+ * @param   thrq        线程队列指针
+ *          len         要写入的数据长度
+ *          deadline    队列满时等待的截止时刻（monotime），0表示一直等待
+ *          flags       0表示队列满时阻塞，THRQ_NOWAIT表示队列满时立即返回
+ *
+ * @return  成功返回槽，失败返回NULL并设置errno
+ *
+ * @note    多生产者多消费者模式下，生产者通过CAS抢占写入位置，提交时把槽序号置为位置+1，消费者见到该序号才读取；
+ *          单生产者单消费者模式下，写入位置直到提交时才前移
+ */
+static thrq_slot_t* thrq_ring_reserve(thrq_cb_t *thrq, size_t len, double deadline, int flags)
+{
+    thrq_ring_t *ring = thrq->ring;
+    if (len > ring->slot_size) {
+        errno = LIB_ERRNO_MBLK_SHORT;
+        return NULL;
+    }
+
+    if (thrq->mode == THRQ_MODE_SPSC) {
+        while (!thrq_spsc_writable(ring, ring->tail)) {
+            if (flags == THRQ_NOWAIT) {
+                errno = LIB_ERRNO_QUE_FULL;
+                return NULL;
+            }
+            if (thrq_ring_park(thrq, true, deadline) == thrd_timeout) {
+                errno = ETIMEDOUT;
+                return NULL;
+            }
+        }
+        return THRQ_RING_SLOT(ring, ring->tail);
+    }
+
+    size_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        thrq_slot_t *slot = THRQ_RING_SLOT(ring, pos);
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t)(seq - pos);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1,
+                                            1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                return slot;
+            continue;
+        }
+        if (dif < 0) {
+            if (flags == THRQ_NOWAIT) {
+                errno = LIB_ERRNO_QUE_FULL;
+                return NULL;
+            }
+            if (thrq_ring_park(thrq, true, deadline) == thrd_timeout) {
+                errno = ETIMEDOUT;
+                return NULL;
+            }
+        }
+        pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief   内部函数，提交thrq_ring_reserve预留的槽，消费者此后才能读取
+ * @param   thrq    线程队列指针
+ *          slot    预留的槽
+ *          len     实际写入的数据长度
+ * @return  void
+ *
+ * @note    不唤醒等待者，调用者提交完（一批）之后调用thrq_ring_wake
+ */
+static void thrq_ring_commit(thrq_cb_t *thrq, thrq_slot_t *slot, size_t len)
+{
+    thrq_ring_t *ring = thrq->ring;
+    size_t tail = (thrq->mode == THRQ_MODE_SPSC) ? ring->tail + 1 : slot->seq + 1;    // seq == pos while reserved
+    uint64_t stamp = thrq_stamp(thrq);
+    slot->len = len;
+    slot->stamp = stamp;
+    if (thrq->mode == THRQ_MODE_SPSC)
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    else
+        __atomic_store_n(&slot->seq, tail, __ATOMIC_RELEASE);
+    if (stamp)      // the slot may already be consumed, do not touch it any more
+        thrq_hist_depth(thrq, (int)(tail - __atomic_load_n(&ring->head, __ATOMIC_RELAXED)));
+}
+
+/**
+ * @brief   内部函数，归还thrq_ring_borrow取出的槽，生产者此后才能覆盖
+ * @param   thrq    线程队列指针
+ *          slot    取出的槽
+ * @return  void
+ *
+ * @note    不唤醒等待者，调用者归还完（一批）之后调用thrq_ring_wake
+ */
+static void thrq_ring_release(thrq_cb_t *thrq, thrq_slot_t *slot)
+{
+    thrq_ring_t *ring = thrq->ring;
+    if (thrq->mode == THRQ_MODE_SPSC)
+        __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    else
+        __atomic_store_n(&slot->seq, slot->seq + ring->mask, __ATOMIC_RELEASE);   // pos + nslots
+}
+
+/**
+ * @brief   内部函数，从环形队列中取出一个有数据的槽，槽在thrq_ring_release之前不会被覆盖
+ * @param   thrq        线程队列指针
+ *          timeout     超时，单位为秒，0表示一直阻塞
+ *          flags       0表示队列空时阻塞，THRQ_NOWAIT表示队列空时立即返回
+ *
+ * @return  成功返回槽，失败返回NULL并设置errno
+ */
+static thrq_slot_t* thrq_ring_borrow(thrq_cb_t *thrq, double timeout, int flags)
+{
+    thrq_ring_t *ring = thrq->ring;
+    double deadline = (timeout > 0) ? monotime() + timeout : 0;
+
+    bool spun = false;
+
+    if (thrq->mode == THRQ_MODE_SPSC) {
+        for (;;) {
+            while (!thrq_spsc_readable(ring, ring->head)) {
+                if (flags == THRQ_NOWAIT) {
+                    errno = LIB_ERRNO_QUE_EMPTY;
+                    return NULL;
+                }
+                if (!spun) {
+                    spun = true;
+                    if (thrq_spin(thrq))
+                        continue;
+                }
+                if (thrq_ring_park(thrq, false, deadline) == thrd_timeout) {
+                    errno = ETIMEDOUT;
+                    return NULL;
+                }
+            }
+            thrq_slot_t *slot = THRQ_RING_SLOT(ring, ring->head);
+            if (slot->len == 0) {       // abandoned reservation, skip it
+                thrq_ring_release(thrq, slot);
+                thrq_ring_wake(ring, true, 1);
+                continue;
+            }
+            thrq_hist_record(thrq, slot->stamp);
+            return slot;
+        }
+    }
+
+    size_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    for (;;) {
+        thrq_slot_t *slot = THRQ_RING_SLOT(ring, pos);
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t)(seq - (pos + 1));
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1,
+                                            1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                if (slot->len == 0) {   // abandoned reservation, skip it
+                    thrq_ring_release(thrq, slot);
+                    thrq_ring_wake(ring, true, 1);
+                    pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+                    continue;
+                }
+                thrq_hist_record(thrq, slot->stamp);
+                return slot;
+            }
+            continue;
+        }
+        if (dif < 0) {
+            if (flags == THRQ_NOWAIT) {
+                errno = LIB_ERRNO_QUE_EMPTY;
+                return NULL;
+            }
+            if (!spun) {
+                spun = true;
+                if (thrq_spin(thrq)) {
+                    pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+                    continue;
+                }
+            }
+            if (thrq_ring_park(thrq, false, deadline) == thrd_timeout) {
+                errno = ETIMEDOUT;
+                return NULL;
+            }
+        }
+        pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief   初始化线程队列为单生产者单消费者的环形队列
+ * @param   thrq        线程队列
+ * @param   slot_size   每条消息的最大长度
+ * @param   nslots      队列容量（消息条数），向上取为2的幂
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ *
+ * @note    同一时刻只允许一个线程发送、一个线程接收；收发都不加锁，只拷贝一次数据，
+ *          只有在队列空（接收）或满（发送）时才通过futex阻塞，没有线程阻塞时发送方不进行任何系统调用。
+ *          队列满时thrq_send阻塞直到有空槽（THRQ_NOWAIT时返回LIB_ERRNO_QUE_FULL）；
+ *          消息长度超过slot_size时thrq_send返回LIB_ERRNO_MBLK_SHORT
+ */
+int thrq_init_spsc(thrq_cb_t *thrq, size_t slot_size, size_t nslots)
+{
+    if (thrq_init(thrq, NULL) != 0)
+        return -1;
+    if ((thrq->ring = thrq_ring_new(slot_size, nslots)) == NULL) {
+        int ec = errno;
+        cnd_destroy(&thrq->cond);
+        cnd_destroy(&thrq->space);
+        mtx_destroy(&thrq->lock);
+        errno = ec;
+        return -1;
+    }
+    thrq->mode = THRQ_MODE_SPSC;
+    return 0;
+}
+
+/**
+ * @brief   初始化线程队列为多生产者多消费者的环形队列
+ * @param   thrq        线程队列
+ * @param   slot_size   每条消息的最大长度
+ * @param   nslots      队列容量（消息条数），向上取为2的幂
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ *
+ * @note    任意多个线程可以同时收发，收发各需一次CAS而不需要加锁（Vyukov的有界队列）；
+ *          阻塞、超时、THRQ_NOWAIT以及错误码与thrq_init_spsc相同
+ */
+int thrq_init_mpmc(thrq_cb_t *thrq, size_t slot_size, size_t nslots)
+{
+    if (thrq_init_spsc(thrq, slot_size, nslots) != 0)
+        return -1;
+    thrq->mode = THRQ_MODE_MPMC;
+    return 0;
+}
+
+/**
+ * @brief   内部函数，环形队列中的消息条数（近似值）
+ */
+static int thrq_ring_count(thrq_ring_t *ring)
+{
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    return (tail > head) ? (int)(tail - head) : 0;
+}
+
+/**
+ * @brief   内部函数，为队列元素分配内存
+ * @param   thrq    线程队列指针
+ *          len     元素内的数据长度
+ *
+ * @return  成功返回元素指针（已设置elm->len），失败返回NULL并设置errno
+ *
+ * @note    只有打开统计时才在元素前面多分配THRQ_STAMP_SIZE字节存放入队时刻，关闭统计时元素不带这部分开销
+ */
+static thrq_elm_t* thrq_elm_alloc(thrq_cb_t *thrq, size_t len)
+{
+    bool stamped = __atomic_load_n(&thrq->hist_on, __ATOMIC_RELAXED);
+    size_t size = THRQ_BLOCK_SIZE(len) + (stamped ? THRQ_STAMP_SIZE : 0);
+    unsigned char *ptr;
+    if (thrq->arena)
+        ptr = (unsigned char *)arena_malloc(thrq->arena, size);
+    else if (thrq->mslab)
+        ptr = (unsigned char *)mslab_malloc(thrq->mslab, size);
+    else if (thrq->mpool)
+        ptr = (unsigned char *)mpool_malloc(thrq->mpool, size);
+    else
+        ptr = (unsigned char *)malloc(size);
+    if (ptr == NULL)
+        return NULL;
+
+    thrq_elm_t *elm = (thrq_elm_t *)(ptr + (stamped ? THRQ_STAMP_SIZE : 0));
+    elm->len = len | (stamped ? THRQ_ELM_STAMPED : 0);
+    return elm;
+}
+
+/**
+ * @brief   内部函数，释放队列元素的内存
+ * @param   thrq    线程队列指针
+ *          elm     队列元素
+ *
+ * @return  void
+ */
+static void thrq_elm_free(thrq_cb_t *thrq, thrq_elm_t *elm)
+{
+    void *ptr = (elm->len & THRQ_ELM_STAMPED) ? (void *)&THRQ_ELM_STAMP(elm) : (void *)elm;
+    if (thrq->arena)
+        return;
+    else if (thrq->mslab)
+        mslab_free(thrq->mslab, ptr);
+    else if (thrq->mpool)
+        mpool_free(thrq->mpool, ptr);
+    else
+        free(ptr);
+}
+
+ /**
+ * @brief   创建线程队列
+ *
+ * @param   thrq    线程队列指针的指针
+ * @param   mp      内存池指针，当为NULL时，采用malloc和free
+ *
+ * @return  返回新建的线程队列，并将该线程队列的指针赋给*thrq（如果thrq不为NULL的话）
+ * @retval  !NULL   成功
+ * @retval  NULL    失败并设置errno
+ *
+ * @par 示例：
+ * @code
+ * thrq_cb_t *thrq = thrq_new(NULL, NULL);
+ * @endcode
+ * 或者
+ * @code
+ * thrq_cb_t *thrq = NULL;
+ * thrq_new(&thrq, NULL);   // thrq will not be NULL if success
+ * @endcode
+ *
+ * @attention 返回的thrq对象需要free
+ */
+thrq_cb_t* thrq_new(thrq_cb_t **thrq, mpool_t *mp)
+{
+    thrq_cb_t *newq = (thrq_cb_t*)malloc(sizeof(thrq_cb_t));
+    if (newq) {
+        if (thrq_init(newq, mp) != 0) {
+            free(newq);
+            newq = NULL;
+        }
+    }
+
+    if (thrq) {
+        *thrq = newq;
+    }
+    return newq;
+}
+
+/**
+ * @brief   创建线程队列，队列本身及其消息都从线性分配器中分配
+ *
+ * @param   thrq    线程队列指针的指针
+ * @param   arena   线性分配器指针
+ *
+ * @return  返回新建的线程队列，并将该线程队列的指针赋给*thrq（如果thrq不为NULL的话）
+ * @retval  !NULL   成功
+ * @retval  NULL    失败并设置errno
+ *
+ * @attention 返回的thrq对象不需要free，但在arena_reset之前仍需要thrq_destroy（销毁互斥锁和条件变量）
+ */
+thrq_cb_t* thrq_new_arena(thrq_cb_t **thrq, arena_t *arena)
+{
+    thrq_cb_t *newq = NULL;
+    if (arena == NULL) {
+        errno = EINVAL;
+    } else if ((newq = (thrq_cb_t*)arena_malloc(arena, sizeof(thrq_cb_t))) != NULL) {
+        if (thrq_init_arena(newq, arena) != 0) {
+            newq = NULL;
+        }
+    }
+
+    if (thrq) {
+        *thrq = newq;
+    }
+    return newq;
+}
+
+/**
+ * @brief   队列是否为空，如果参数是NULL则“队列”始终为”空“
+ * @param   thrq    线程队列指针
+ * @retval  true    队列空
+ * @retval  false   队列不空
+ */
+bool thrq_empty(thrq_cb_t *thrq)
+{
+    if (thrq == NULL) {
+        return true;
+    }
+    if (thrq->ring)
+        return thrq_ring_count(thrq->ring) == 0;
+    mtx_lock(&thrq->lock);
+    bool empty = THRQ_EMPTY(thrq);
+    mtx_unlock(&thrq->lock);
+    return empty;
+}
+
+/**
+ * @brief   队列元素个数（或者有多少块数据）
+ * @param   thrq    线程队列指针
+ * @return  返回队列元素个数，如果参数为NULL，则返回0
+ */
+int thrq_count(thrq_cb_t *thrq)
+{
+    if (thrq == NULL) {
+        return 0;
+    }
+    if (thrq->ring)
+        return thrq_ring_count(thrq->ring);
+    mtx_lock(&thrq->lock);
+    int count = thrq->count;
+    mtx_unlock(&thrq->lock);
+    return count;
+}
+
+/**
+ * @brief   内部函数，消息入队后使eventfd可读
+ * @param   thrq    线程队列指针
+ * @return  void
+ *
+ * @note    efd_armed为1时eventfd已经可读，不再进行系统调用；
+ *          入队与读取efd_armed之间需要全屏障，与thrq_efd_clear中“清除efd_armed、再检查队列”的顺序相对应
+ */
+static void thrq_efd_notify(thrq_cb_t *thrq)
+{
+    int efd = __atomic_load_n(&thrq->efd, __ATOMIC_ACQUIRE);
+    if (efd < 0)
+        return;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&thrq->efd_armed, __ATOMIC_RELAXED) ||
+        __atomic_exchange_n(&thrq->efd_armed, 1, __ATOMIC_RELAXED))
+        return;
+    int ec = errno;
+    uint64_t one = 1;
+    ssize_t res = write(efd, &one, sizeof(one));
+    (void)res;          // only fails when the counter would overflow, which can not happen here
+    errno = ec;
+}
+
+/**
+ * @brief   内部函数，接收之后队列已空时使eventfd不可读
+ * @param   thrq    线程队列指针
+ * @return  void
+ *
+ * @note    清除后再检查一次队列，避免与并发的thrq_efd_notify竞争而丢失可读事件
+ */
+static void thrq_efd_clear(thrq_cb_t *thrq)
+{
+    int efd = __atomic_load_n(&thrq->efd, __ATOMIC_ACQUIRE);
+    if (efd < 0 || __atomic_load_n(&thrq->efd_armed, __ATOMIC_RELAXED) == 0 || thrq_readable(thrq))
+        return;
+
+    int ec = errno;
+    uint64_t cnt;
+    ssize_t res = read(efd, &cnt, sizeof(cnt));
+    (void)res;          // EAGAIN if already drained
+    __atomic_store_n(&thrq->efd_armed, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (thrq_readable(thrq))
+        thrq_efd_notify(thrq);
+    errno = ec;
+}
+
+/**
+ * @brief   获取线程队列的可读通知描述符(eventfd)，首次调用时创建
+ * @param   thrq    线程队列指针
+ *
+ * @return  成功返回文件描述符，失败返回-1并设置errno
+ *
+ * @note    队列中有消息时描述符可读，可以与socket、tty等描述符一起交给select/poll/epoll等待；
+ *          可读之后应以THRQ_NOWAIT接收，直到返回LIB_ERRNO_QUE_EMPTY（或者接收到最后一条消息）时描述符才变为不可读。
+ *          描述符由队列持有，thrq_destroy时关闭，调用者不能读写或关闭它
+ * @par     举例：
+ * @code
+ * struct epoll_event ev = {.events = EPOLLIN, .data.ptr = thrq};
+ * epoll_ctl(epfd, EPOLL_CTL_ADD, thrq_eventfd(thrq), &ev);
+ * ...
+ * while ((num = thrq_receive(thrq, buf, bufsize, 0, THRQ_NOWAIT)) > 0) {
+ *     // handle message
+ * }
+ * @endcode
+ */
+int thrq_eventfd(thrq_cb_t *thrq)
+{
+    if (thrq == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mtx_lock(&thrq->lock);
+    if (thrq->efd < 0) {
+        int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (efd < 0) {
+            int ec = errno;
+            mtx_unlock(&thrq->lock);
+            errno = ec;
+            return -1;
+        }
+        thrq->efd_armed = 0;
+        __atomic_store_n(&thrq->efd, efd, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (thrq->ring ? thrq_ring_count(thrq->ring) > 0 : thrq->count > 0)
+            thrq_efd_notify(thrq);      // messages sent before the fd existed
+    }
+    mtx_unlock(&thrq->lock);
+    return thrq->efd;
+}
+
+/**
+ * @brief   同时等待多个线程队列，直到其中至少一个队列有消息
+ * @param   thrqs       线程队列数组，其中为NULL的元素被忽略
+ *          n           队列个数
+ *          ready       输出每个队列是否有消息，可以为NULL
+ *          timeout     等待超时，单位为秒，0表示一直阻塞直到有队列有消息为止
+ *          flags       阻塞标志：0表示阻塞，THRQ_NOWAIT表示只检查一次而不等待
+ *
+ * @return  成功返回有消息的队列个数，失败返回-1并设置errno（超时为ETIMEDOUT，都没有消息且THRQ_NOWAIT时为LIB_ERRNO_QUE_EMPTY，
+ *          某个队列的eventfd创建失败时为thrq_eventfd的errno，如EMFILE）
+ *
+ * @note    先不加锁地检查各队列，都为空时通过各队列的eventfd（thrq_eventfd，首次调用时创建）在poll中休眠，
+ *          不需要为每个队列单独的线程，也不需要轮询；返回后应以THRQ_NOWAIT从有消息的队列中接收。
+ *          环形队列模式下调用者必须是该队列的（唯一）消费者
+ * @par     举例：
+ * @code
+ * thrq_cb_t *qs[] = {&cmd_q, &data_q};
+ * bool ready[2];
+ * for (;;) {
+ *     if (thrq_select(qs, 2, ready, 1.0, 0) < 0)
+ *         continue;   // ETIMEDOUT
+ *     if (ready[0])
+ *         while (thrq_receive(&cmd_q, buf, sizeof(buf), 0, THRQ_NOWAIT) > 0) { ... }
+ *     if (ready[1])
+ *         while (thrq_receive(&data_q, buf, sizeof(buf), 0, THRQ_NOWAIT) > 0) { ... }
+ * }
+ * @endcode
+ */
+int thrq_select(thrq_cb_t *thrqs[], int n, bool ready[], double timeout, int flags)
+{
+    if (thrqs == NULL || n <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct pollfd *fds = NULL;  // allocated only when every queue is empty and we have to sleep
+    double deadline = (timeout > 0) ? monotime() + timeout : 0;
+    bool armed = false;         // eventfds created, readiness re-checked after that
+    int ret = -1;
+    for (;;) {
+        int num = 0;
+        for (int i=0; i<n; i++) {
+            bool rd = (thrqs[i] != NULL && thrq_readable(thrqs[i]));
+            if (ready)
+                ready[i] = rd;
+            num += rd;
+        }
+        if (num > 0) {
+            ret = num;
+            break;
+        }
+        if (flags == THRQ_NOWAIT) {
+            errno = LIB_ERRNO_QUE_EMPTY;
+            break;
+        }
+
+        if (armed) {
+            /* readable fds of empty queues are stale (the messages were taken by a receive without a clear) */
+            for (int i=0; i<n; i++) {
+                if (fds[i].fd >= 0 && (fds[i].revents & POLLIN))
+                    thrq_efd_clear(thrqs[i]);
+            }
+        }
+
+        int ms = -1;
+        if (deadline > 0) {
+            double left = deadline - monotime();
+            if (left <= 0) {
+                errno = ETIMEDOUT;
+                break;
+            }
+            ms = (int)(left * 1000) + 1;
+        }
+        if (fds == NULL && (fds = (struct pollfd *)malloc(n * sizeof(struct pollfd))) == NULL)
+            break;
+        int i;
+        for (i=0; i<n; i++) {
+            fds[i].fd = -1;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+            /* a queue without an eventfd could never wake us up */
+            if (thrqs[i] && (fds[i].fd = thrq_eventfd(thrqs[i])) < 0)
+                break;
+        }
+        if (i < n)
+            break;
+        // re-check once the fds exist, a message may have arrived before thrq_eventfd created them
+        if (!armed) {
+            armed = true;
+            continue;
+        }
+        if (poll(fds, n, ms) < 0 && errno != EINTR)
+            break;
+    }
+
+    int ec = errno;
+    free(fds);
+    errno = ec;
+    return ret;
+}
+
+/**
+ * @brief   同时等待多个线程队列，返回第一个有消息的队列
+ * @param   thrqs       线程队列数组，其中为NULL的元素被忽略
+ *          n           队列个数
+ *          timeout     等待超时，单位为秒，0表示一直阻塞直到有队列有消息为止
+ *
+ * @return  成功返回有消息的队列中下标最小的一个，失败返回-1并设置errno（超时为ETIMEDOUT）
+ *
+ * @note    数组中靠前的队列优先，可以把控制队列放在前面
+ */
+int thrq_wait_any(thrq_cb_t *thrqs[], int n, double timeout)
+{
+    if (thrqs == NULL || n <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    double deadline = (timeout > 0) ? monotime() + timeout : 0;
+    for (;;) {
+        if (thrq_select(thrqs, n, NULL, timeout, 0) < 0)
+            return -1;
+        for (int i=0; i<n; i++) {
+            if (thrqs[i] != NULL && thrq_readable(thrqs[i]))
+                return i;
+        }
+        /* taken by another receiver in the meantime, wait for the rest of the timeout */
+        if (deadline > 0 && (timeout = deadline - monotime()) <= 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+}
+
+/**
+ * @brief   内部函数，队列长度变化后检查是否越过高低水位线，越过时调用水位回调（不能持有队列锁）
+ * @param   thrq    线程队列指针
+ * @return  void
+ *
+ * @note    同一时刻只有一个线程（置位mark_busy者）调用回调，它每次调用前都重新读取队列长度，
+ *          保证高低水位回调交替出现且不会被并发的收发打乱顺序；其他线程发现mark_busy已置位时直接返回，
+ *          由调用回调的线程在清除mark_busy之后重新检查，所以不会错过在此期间越过的水位；
+ *          回调中再收发同一队列也不会死锁（内层的检查直接返回）
+ */
+static void thrq_mark_check(thrq_cb_t *thrq)
+{
+    thrq_mark_cb_t cb = __atomic_load_n(&thrq->mark_cb, __ATOMIC_ACQUIRE);
+    if (cb == NULL)
+        return;
+
+    for (;;) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        int count = thrq->ring ? thrq_ring_count(thrq->ring) : __atomic_load_n(&thrq->count, __ATOMIC_ACQUIRE);
+        int marked = __atomic_load_n(&thrq->marked, __ATOMIC_RELAXED);
+        if (!(marked == 0 && count >= thrq->high_mark) && !(marked != 0 && count <= thrq->low_mark))
+            return;
+        if (__atomic_exchange_n(&thrq->mark_busy, 1, __ATOMIC_ACQUIRE))
+            return;     // the thread calling back will check again when it is done
+
+        for (;;) {
+            count = thrq->ring ? thrq_ring_count(thrq->ring) : __atomic_load_n(&thrq->count, __ATOMIC_ACQUIRE);
+            if (thrq->marked == 0 && count >= thrq->high_mark) {
+                __atomic_store_n(&thrq->marked, 1, __ATOMIC_RELAXED);
+                cb(thrq->mark_arg, true);
+            } else if (thrq->marked != 0 && count <= thrq->low_mark) {
+                __atomic_store_n(&thrq->marked, 0, __ATOMIC_RELAXED);
+                cb(thrq->mark_arg, false);
+            } else {
+                break;
+            }
+        }
+        __atomic_store_n(&thrq->mark_busy, 0, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * @brief   内部函数，链表模式下修改队列长度（须持有锁）
+ * @param   thrq    线程队列指针
+ *          n       增加的元素个数，负数表示减少
+ * @return  void
+ *
+ * @note    队列长度减少时唤醒因队列满而等待的发送方（减少多个时唤醒全部）
+ */
+static void thrq_count_add(thrq_cb_t *thrq, int n)
+{
+    int count = thrq->count + n;
+    if (count < 0)
+        count = 0;
+    __atomic_store_n(&thrq->count, count, __ATOMIC_RELEASE);     // read without lock by thrq_readable
+    if (n < 0 && thrq->nwait_send > 0) {
+        if (n == -1 || thrq->nwait_send == 1)
+            cnd_signal(&thrq->space);
+        else
+            cnd_broadcast(&thrq->space);
+    }
+}
+
+/**
+ * @brief   内部函数，环形队列收发之后唤醒对端并检查水位
+ * @param   thrq    线程队列指针
+ *          writer  true表示刚归还了槽（唤醒发送方），false表示刚提交了消息（唤醒接收方）
+ *          n       归还或提交的个数
+ * @return  void
+ */
+static void thrq_ring_done(thrq_cb_t *thrq, bool writer, int n)
+{
+    thrq_ring_wake(thrq->ring, writer, n);
+    if (__atomic_load_n(&thrq->mark_cb, __ATOMIC_RELAXED))
+        thrq_mark_check(thrq);
+}
+
+/**
+ * @brief   内部函数，链表模式下收发之后解锁，再检查水位（水位回调不在锁内调用）
+ * @param   thrq    线程队列指针
+ * @return  void
+ */
+static void thrq_unlock(thrq_cb_t *thrq)
+{
+    mtx_unlock(&thrq->lock);
+    if (__atomic_load_n(&thrq->mark_cb, __ATOMIC_RELAXED))
+        thrq_mark_check(thrq);
+}
+
+/**
+ * @brief   内部函数，把相对超时转换为条件变量使用的绝对时刻
+ * @param   ts          输出的绝对时刻
+ *          timeout     超时，单位为秒
+ * @return  void
+ */
+static void thrq_abstime(struct timespec *ts, double timeout)
+{
+    timespec_get(ts, TIME_MONO);
+    // ok, max_long_int = 2.1s > (1s + 1s)
+    ts->tv_nsec = (long)((timeout - (long)timeout) * 1000000000L) + ts->tv_nsec;
+    ts->tv_sec = (time_t)timeout + ts->tv_sec + (ts->tv_nsec / 1000000000L);
+    ts->tv_nsec = ts->tv_nsec % 1000000000L;
+}
+
+/**
+ * @brief   内部函数，链表模式下加锁并等待队列中有空位
+ * @param   thrq        线程队列指针
+ *          timeout     发送超时，单位为秒，0表示一直阻塞直到有空位为止
+ *          flags       阻塞标志：0表示阻塞，THRQ_NOWAIT表示不阻塞
+ *
+ * @return  成功返回0，此时已持有锁且队列未满；失败返回-1并设置errno，此时未持有锁
+ */
+static int thrq_lock_space(thrq_cb_t *thrq, double timeout, int flags)
+{
+    if (flags == THRQ_NOWAIT) {
+        if (mtx_trylock(&thrq->lock) == thrd_busy) {
+            return -1;
+        }
+        if (thrq->count + thrq->reserved >= thrq->capacity) {
+            mtx_unlock(&thrq->lock);
+            errno = LIB_ERRNO_QUE_FULL;
+            return -1;
+        }
+        return 0;
+    }
+
+    int res = 0;
+    struct timespec ts;
+    if (timeout > 0)
+        thrq_abstime(&ts, timeout);
+
+    mtx_lock(&thrq->lock);
+    while (res == 0 && thrq->count + thrq->reserved >= thrq->capacity) {
+        thrq->nwait_send++;
+        if (timeout > 0) {
+            res = cnd_timedwait(&thrq->space, &thrq->lock, &ts);
+        } else {
+            res = cnd_wait(&thrq->space, &thrq->lock);
+        }
+        thrq->nwait_send--;
+    }
+    if (res != 0) {
+        mtx_unlock(&thrq->lock);
+        errno = (res == thrd_timeout || res == thrd_busy) ? ETIMEDOUT : EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief   内部函数，把元素加入优先级通道的队尾（须持有锁）
+ * @param   thrq    线程队列指针
+ *          elm     元素
+ *          prio    优先级通道
+ * @return  void
+ */
+static void thrq_link(thrq_cb_t *thrq, thrq_elm_t *elm, int prio)
+{
+    TAILQ_INSERT_TAIL(&thrq->head[prio], elm, entry);
+    thrq->prio_mask |= 1u << prio;
+    thrq_count_add(thrq, 1);
+    if (elm->len & THRQ_ELM_STAMPED) {
+        THRQ_ELM_STAMP(elm) = thrq_stamp(thrq);
+        thrq_hist_depth(thrq, thrq->count);
+    }
+}
+
+/**
+ * @brief   内部函数，摘下队首元素，不修改队列长度（须持有锁）
+ * @param   thrq    线程队列指针
+ *          elm     队首元素，即THRQ_FIRST(thrq)，它所在的通道就是最高的非空通道
+ * @return  void
+ *
+ * @note    调用者随后通过thrq_count_add一次性减去摘下的元素个数
+ */
+static void thrq_detach(thrq_cb_t *thrq, thrq_elm_t *elm)
+{
+    int prio = THRQ_TOP_PRIO(thrq);
+    TAILQ_REMOVE(&thrq->head[prio], elm, entry);
+    if (TAILQ_EMPTY(&thrq->head[prio]))
+        thrq->prio_mask &= ~(1u << prio);
+    if (elm->len & THRQ_ELM_STAMPED)
+        thrq_hist_record(thrq, THRQ_ELM_STAMP(elm));
+}
+
+/**
+ * @brief   内部函数，摘下队首元素（须持有锁）
+ * @param   thrq    线程队列指针
+ *          elm     队首元素
+ * @return  void
+ */
+static void thrq_unlink(thrq_cb_t *thrq, thrq_elm_t *elm)
+{
+    thrq_detach(thrq, elm);
+    thrq_count_add(thrq, -1);
+}
+
+/**
+ * @brief   内部函数，删除队首元素
+ * @param   thrq    线程队列指针
+ *          elm     队首元素
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ */
+static int thrq_remove(thrq_cb_t *thrq, thrq_elm_t *elm)
+{
+    if (thrq == NULL || elm == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mtx_lock(&thrq->lock);
+    thrq_unlink(thrq, elm);
+    thrq_elm_free(thrq, elm);
+    mtx_unlock(&thrq->lock);
+    return 0;
+}
+
+/**
+ * @brief   内部函数，插入元素到队列
+ * @param   thrq    线程队列指针
+ *          data    插入的数据指针
+ *          len     插入的数据长度
+ *          prio    优先级通道，高于THRQ_PRIO_NORMAL时不受容量限制
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ */
+static int thrq_insert_tail(thrq_cb_t *thrq, void *data, size_t len, int prio)
+{
+    if (data == 0 || len == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mtx_lock(&thrq->lock);
+    if (prio == THRQ_PRIO_NORMAL && thrq->count + thrq->reserved >= thrq->capacity) {
+        mtx_unlock(&thrq->lock);
+        errno = LIB_ERRNO_QUE_FULL;
+        return -1;
+    }
+
+    thrq_elm_t *elm = thrq_elm_alloc(thrq, len);
+    if (elm == 0) {
+        int ec = errno;             // backup errno
+        mtx_unlock(&thrq->lock);    // errno may be modified
+        errno = ec;
+        return -1;
+    }
+    memcpy(elm->data, data, len);
+    thrq_link(thrq, elm, prio);
+
+    mtx_unlock(&thrq->lock);
+    return 0;
+}
+
+/**
+ * @brief   销毁线程队列
+ * @param   thrq    线程队列指针
+ * @return  void
+ */
+void thrq_destroy(thrq_cb_t *thrq)
+{
+    if (thrq) {
+        mtx_lock(&thrq->lock);
+        cnd_destroy(&thrq->cond);
+        cnd_destroy(&thrq->space);
+        thrq->mark_cb = NULL;
+        thrq->nwait_send = 0;
+        thrq->hist_on = 0;
+        while (!THRQ_EMPTY(thrq)) {
+            thrq_remove(thrq, THRQ_FIRST(thrq));
+        }
+        free(thrq->hist);
+        thrq->hist = NULL;
+        thrq->mpool = NULL;
+        thrq->mslab = NULL;
+        thrq->arena = NULL;
+        free(thrq->ring);
+        thrq->ring = NULL;
+        thrq->mode = THRQ_MODE_LIST;
+        if (thrq->efd >= 0) {
+            close(thrq->efd);
+            thrq->efd = -1;
+        }
+        mtx_unlock(&thrq->lock);
+
+        mtx_destroy(&thrq->lock);
+    }
+}
+
+/**
+ * @brief   设置链表模式下队列的容量（最多容纳的消息条数）
+ * @param   thrq        线程队列指针
+ *          capacity    容量，必须大于0，默认为THRQ_MAX_SIZE
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ *
+ * @note    队列满时thrq_send阻塞（或者以THRQ_NOWAIT返回LIB_ERRNO_QUE_FULL），直到接收方取走消息；
+ *          环形队列的容量在初始化时由nslots确定，不能修改
+ */
+int thrq_set_capacity(thrq_cb_t *thrq, int capacity)
+{
+    if (thrq == NULL || capacity <= 0 || thrq->ring) {
+        errno = EINVAL;
+        return -1;
+    }
+    mtx_lock(&thrq->lock);
+    thrq->capacity = capacity;
+    if (thrq->nwait_send > 0)
+        cnd_broadcast(&thrq->space);
+    mtx_unlock(&thrq->lock);
+    return 0;
+}
+
+/**
+ * @brief   设置队列的高低水位线及回调
+ * @param   thrq    线程队列指针
+ *          high    高水位线，队列长度增加到high时以true调用回调
+ *          low     低水位线，越过高水位之后队列长度减少到low时以false调用回调，须小于high
+ *          cb      水位回调，NULL表示取消
+ *          arg     回调的参数
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ *
+ * @note    上游（如UDP、tty的读线程）可以在高水位时暂停读取、低水位时恢复，而不是在队列满时丢弃数据；
+ *          回调在收发线程中调用（不持有队列锁，同一时刻只有一个线程在调用），应尽快返回
+ * @par     举例：
+ * @code
+ * static void on_mark(void *arg, bool high)
+ * {
+ *     __atomic_store_n((bool *)arg, high, __ATOMIC_RELAXED);  // reader thread checks it before recvfrom
+ * }
+ * thrq_set_watermark(thrq, 4096, 1024, on_mark, &throttled);
+ * @endcode
+ */
+int thrq_set_watermark(thrq_cb_t *thrq, int high, int low, thrq_mark_cb_t cb, void *arg)
+{
+    if (thrq == NULL || (cb && (low < 0 || low >= high))) {
+        errno = EINVAL;
+        return -1;
+    }
+    mtx_lock(&thrq->lock);
+    thrq->high_mark = high;
+    thrq->low_mark = low;
+    thrq->mark_arg = arg;
+    thrq->marked = 0;
+    __atomic_store_n(&thrq->mark_cb, cb, __ATOMIC_RELEASE);
+    mtx_unlock(&thrq->lock);
+    return 0;
+}
+
+/**
+ * @brief   打开或关闭排队时间统计
+ * @param   thrq    线程队列指针
+ *          enable  true表示打开，false表示关闭
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ *
+ * @note    打开后每条消息在发送时取一次单调时钟作为时间戳，接收（或借出）时把排队时间记入直方图，
+ *          并在发送时记录队列长度的最高水位；记录只用无锁的原子操作，开销为每条消息两次clock_gettime；
+ *          直方图在第一次打开时分配，关闭后保留已有的统计，直到销毁队列；
+ *          链表模式下打开统计期间发送的元素前面多占THRQ_STAMP_SIZE字节存放时间戳
+ */
+int thrq_set_stats(thrq_cb_t *thrq, bool enable)
+{
+    if (thrq == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (enable && __atomic_load_n(&thrq->hist, __ATOMIC_ACQUIRE) == NULL) {
+        thrq_hist_t *hist = (thrq_hist_t *)calloc(1, sizeof(thrq_hist_t));
+        if (hist == NULL)
+            return -1;
+        thrq_hist_t *expected = NULL;
+        if (!__atomic_compare_exchange_n(&thrq->hist, &expected, hist, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            free(hist);     // installed by another thread
+    }
+    __atomic_store_n(&thrq->hist_on, enable ? 1 : 0, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * @brief   读取排队时间统计
+ * @param   thrq    线程队列指针
+ *          stats   输出的统计结果
+ *          reset   true表示读取的同时清零
+ *
+ * @return  成功返回0，失败返回-1并设置errno（从未打开统计时为LIB_ERRNO_NOT_EXIST）
+ *
+ * @note    不加锁，可以在收发的同时调用；各分位数取所在桶的上界（与真实值的相对误差不超过1/THRQ_HIST_SUB），
+ *          且不超过max；与收发并发时，各字段是逐个读取（清零）的，彼此之间可能相差正在记录的几条消息
+ *
+ * @par     示例
+ * @code
+ * thrq_stats_t st;
+ * if (thrq_stats(thrq, &st, true) == 0 && st.count > 0) {
+ *     printf("queued %llu msgs, p50 %lluns p99 %lluns p999 %lluns max %lluns, depth %d\n",
+ *            st.count, st.p50, st.p99, st.p999, st.max, st.depth_max);
+ * }
+ * @endcode
+ */
+int thrq_stats(thrq_cb_t *thrq, thrq_stats_t *stats, bool reset)
+{
+    if (thrq == NULL || stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    thrq_hist_t *hist = __atomic_load_n(&thrq->hist, __ATOMIC_ACQUIRE);
+    if (hist == NULL) {
+        errno = LIB_ERRNO_NOT_EXIST;
+        return -1;
+    }
+
+#define THRQ_HIST_READ(p)   (reset ? __atomic_exchange_n(p, 0, __ATOMIC_RELAXED) : __atomic_load_n(p, __ATOMIC_RELAXED))
+    uint64_t bucket[THRQ_HIST_BUCKETS];
+    uint64_t total = 0;
+    for (int i=0; i<THRQ_HIST_BUCKETS; i++) {
+        bucket[i] = THRQ_HIST_READ(&hist->bucket[i]);
+        total += bucket[i];
+    }
+    uint64_t sum = THRQ_HIST_READ(&hist->sum);
+    uint64_t max = THRQ_HIST_READ(&hist->max);
+    int depth_max = THRQ_HIST_READ(&hist->depth_max);
+#undef THRQ_HIST_READ
+
+    memset(stats, 0, sizeof(*stats));
+    stats->count = total;
+    stats->max = max;
+    stats->depth_max = depth_max;
+    if (total == 0)
+        return 0;
+    stats->mean = sum / total;
+
+    /* the rank of each percentile, rounded up */
+    uint64_t *pv[3] = { &stats->p50, &stats->p99, &stats->p999 };
+    uint64_t rank[3] = { (total * 500 + 999) / 1000, (total * 990 + 999) / 1000, (total * 999 + 999) / 1000 };
+    uint64_t acc = 0;
+    int k = 0;
+    for (int i=0; i<THRQ_HIST_BUCKETS && k<3; i++) {
+        acc += bucket[i];
+        while (k < 3 && acc >= rank[k]) {
+            uint64_t v = thrq_hist_value(i);
+            *pv[k++] = (v < max) ? v : max;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief   内部函数，发送队列消息到指定的优先级通道
+ * @param   thrq        线程队列指针
+ *          data        发送的数据指针
+ *          len         发送的数据长度
+ *          prio        优先级通道
+ *          timeout     队列满时的等待超时，单位为秒，0表示一直阻塞
+ *          flags       阻塞标志：0表示阻塞，THRQ_NOWAIT表示不阻塞
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ */
+static int thrq_send_lane(thrq_cb_t *thrq, void *data, size_t len, int prio, double timeout, int flags)
+{
+    if (thrq == NULL || data == NULL || len == 0 || prio < 0 || prio >= THRQ_PRIO_NUM ||
+        (thrq->ring && prio != THRQ_PRIO_NORMAL)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (thrq->ring) {
+        double deadline = (timeout > 0) ? monotime() + timeout : 0;
+        thrq_slot_t *slot = thrq_ring_reserve(thrq, len, deadline, flags);
+        if (slot == NULL)
+            return -1;
+        memcpy(slot->data, data, len);
+        thrq_ring_commit(thrq, slot, len);
+        thrq_ring_done(thrq, false, 1);
+        thrq_efd_notify(thrq);
+        return 0;
+    }
+
+    if (prio == THRQ_PRIO_NORMAL) {
+        if (thrq_lock_space(thrq, timeout, flags) != 0)
+            return -1;
+    } else if (flags == THRQ_NOWAIT) {
+        if (mtx_trylock(&thrq->lock) == thrd_busy)
+            return -1;
+    } else {
+        mtx_lock(&thrq->lock);
+    }
+    if (thrq_insert_tail(thrq, data, len, prio) != 0) {
+        mtx_unlock(&thrq->lock);
+        return -1;
+    }
+    bool wake = (thrq->nwait > 0);      // skip the futex syscall when no receiver is parked
+    thrq_unlock(thrq);
+    thrq_efd_notify(thrq);
+
+    int res;
+    if (wake && (res = cnd_signal(&thrq->cond)) != 0) {
+        errno = res;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief   以阻塞或非阻塞方式发送队列消息
+ * @param   thrq    线程队列指针
+ *          data    发送的数据指针
+ *          len     发送的数据长度
+ *          flags   阻塞标志：0表示阻塞，THRQ_NOWAIT表示不阻塞（即锁被占用或者队列满时立即返回）
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ *
+ * @note    阻塞时一直等待到队列有空位为止，等同于超时为0的thrq_send_timeout
+ */
+int thrq_send(thrq_cb_t *thrq, void *data, size_t len, int flags)
+{
+    return thrq_send_timeout(thrq, data, len, 0, flags);
+}
+
+/**
+ * @brief   以阻塞或非阻塞方式发送队列消息，队列满时最多等待timeout秒
+ * @param   thrq        线程队列指针
+ *          data        发送的数据指针
+ *          len         发送的数据长度
+ *          timeout     发送超时，单位为秒，0表示一直阻塞直到队列有空位为止
+ *          flags       阻塞标志：0表示阻塞，THRQ_NOWAIT表示不阻塞（即锁被占用或者队列满时立即返回）
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ *
+ * @note    队列满时THRQ_NOWAIT返回LIB_ERRNO_QUE_FULL，超时返回ETIMEDOUT；
+ *          链表模式下的容量由thrq_set_capacity设置，环形队列的容量为初始化时的槽数
+ */
+int thrq_send_timeout(thrq_cb_t *thrq, void *data, size_t len, double timeout, int flags)
+{
+    return thrq_send_lane(thrq, data, len, THRQ_PRIO_NORMAL, timeout, flags);
+}
+
+/**
+ * @brief   以指定的优先级发送队列消息
+ * @param   thrq    线程队列指针
+ *          data    发送的数据指针
+ *          len     发送的数据长度
+ *          prio    优先级，THRQ_PRIO_NORMAL ~ THRQ_PRIO_NUM-1，越大越优先
+ *          flags   阻塞标志：0表示阻塞，THRQ_NOWAIT表示不阻塞（含义与thrq_send相同）
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ *
+ * @note    每个优先级是一个独立的先进先出通道，接收时总是取最高的非空通道的队首（通过位图O(1)找到），
+ *          所以控制消息不会排在大量普通消息之后；高于THRQ_PRIO_NORMAL的消息不受容量限制，也不会因队列满而阻塞，
+ *          只应用于少量的控制消息。只有链表模式支持优先级，环形队列模式下prio必须为THRQ_PRIO_NORMAL
+ */
+int thrq_send_prio(thrq_cb_t *thrq, void *data, size_t len, int prio, int flags)
+{
+    return thrq_send_lane(thrq, data, len, prio, 0, flags);
+}
+
+/**
+ * @brief   内部函数，链表模式下加锁并等待队列中有数据
+ * @param   thrq        线程队列指针
+ *          timeout     接收超时，单位为秒，0表示一直阻塞直到有数据为止
+ *          flags       阻塞标志：0表示阻塞，THRQ_NOWAIT表示不阻塞
+ *
+ * @return  成功返回0，此时已持有锁且队列非空；失败返回-1并设置errno，此时未持有锁
+ */
+static int thrq_lock_wait(thrq_cb_t *thrq, double timeout, int flags)
+{
+    if (flags != THRQ_NOWAIT && !thrq_readable(thrq))
+        thrq_spin(thrq);
+
+    int res = 0;
+    struct timespec ts;
+    if (timeout > 0)
+        thrq_abstime(&ts, timeout);
+
+    if (flags == THRQ_NOWAIT) {
+        if (mtx_trylock(&thrq->lock) == thrd_busy) {
+            return -1;
+        }
+    } else {
+        mtx_lock(&thrq->lock);
+    }
+
+    if (flags != THRQ_NOWAIT) {
+        /* break when error occured or data receive */
+        while (res == 0 && thrq->count == 0) {
+            thrq->nwait++;
+            if (timeout > 0) {
+                res = cnd_timedwait(&thrq->cond, &thrq->lock, &ts);
+            } else {
+                res = cnd_wait(&thrq->cond, &thrq->lock);
+            }
+            thrq->nwait--;
+        }
+        if (res != 0) {
+            mtx_unlock(&thrq->lock);
+            if (res == thrd_timeout || res == thrd_busy)   // cnd_timedwait reports timeout as thrd_busy
+                errno = ETIMEDOUT;
+            return -1;      // errno may be the ETIMEDOUT
+        }
+    } else {
+        if (thrq->count == 0) {
+            errno = LIB_ERRNO_QUE_EMPTY;
+            mtx_unlock(&thrq->lock);
+            return -1;
+        }
+    }
     return 0;
 }
 
- /**
- * @brief   创建线程队列
- *
- * @param   thrq    线程队列指针的指针
- * @param   mp      内存池指针，当为NULL时，采用malloc和free
+/**
+ * @brief   以阻塞或非阻塞方式接收队列消息
+ * @param   thrq        线程队列指针
+ *          buf         接收缓存
+ *          max_size    接收缓存的大小
+ *          timeout     接收超时，单位为秒，0表示一直阻塞直到收到数据为止
+ *          flags       阻塞标志：0表示阻塞，THRQ_NOWAIT表示不阻塞(即锁被占用或者无数据时立即返回)
  *
- * @return  返回新建的线程队列，并将该线程队列的指针赋给*thrq（如果thrq不为NULL的话）
- * @retval  !NULL   成功
- * @retval  NULL    失败并设置errno
+ * @return  成功返回实际收到的数据长度,失败返回-1并设置错误码
  *
- * @par 示例：
- * @code
- * thrq_cb_t *thrq = thrq_new(NULL, NULL);
- * @endcode
- * 或者
+ * @note    当函数收到数据或者发送错误时，将从阻塞状态返回；
+ *          通过检查errno是否为 ETIMEDOUT 可以判断函数是否是超时返回
+ * @par     举例：
  * @code
- * thrq_cb_t *thrq = NULL;
- * thrq_new(&thrq, NULL);   // thrq will not be NULL if success
+ * int num;
+ * double tout = 3.0;
+ * for (;;) {
+ *     if ((num = thrq_receive(thrq, buf, bufsize, tout, 0)) == -1) {
+ *         if (errno == ETIMEDOUT) {
+ *             printf("receive timeout %.1fs\n", tout);
+ *             continue;
+ *         }
+ *     }
+ * }
  * @endcode
- *
- * @attention 返回的thrq对象需要free
  */
-thrq_cb_t* thrq_new(thrq_cb_t **thrq, mpool_t *mp)
+int thrq_receive(thrq_cb_t *thrq, void *buf, size_t bufsize, double timeout, int flags)
 {
-    thrq_cb_t *newq = (thrq_cb_t*)malloc(sizeof(thrq_cb_t));
-    if (newq) {
-        if (thrq_init(newq, mp) != 0) {
-            free(newq);
-            newq = NULL;
+    if (thrq == NULL || buf == NULL || bufsize == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (thrq->ring) {
+        thrq_slot_t *slot = thrq_ring_borrow(thrq, timeout, flags);
+        if (slot == NULL) {
+            thrq_efd_clear(thrq);
+            return -1;
         }
+        size_t cpsize = (bufsize < slot->len) ? bufsize : slot->len;
+        memcpy(buf, slot->data, cpsize);
+        thrq_ring_release(thrq, slot);
+        thrq_ring_done(thrq, true, 1);
+        thrq_efd_clear(thrq);
+        return cpsize;
     }
 
-    if (thrq) {
-        *thrq = newq;
+    if (thrq_lock_wait(thrq, timeout, flags) != 0) {
+        thrq_efd_clear(thrq);
+        return -1;
     }
-    return newq;
+
+    thrq_elm_t *elm = THRQ_FIRST(thrq);
+    size_t cpsize = (bufsize < THRQ_ELM_LEN(elm)) ? bufsize : THRQ_ELM_LEN(elm);
+    memcpy(buf, elm->data, cpsize);
+    thrq_remove(thrq, elm);
+
+    thrq_unlock(thrq);
+    thrq_efd_clear(thrq);
+    return cpsize;
 }
 
 /**
- * @brief   队列是否为空，如果参数是NULL则“队列”始终为”空“
+ * @brief   在队列中预留一块发送缓存，调用者直接在其中构造消息后通过thrq_send_commit发送，省去一次拷贝
  * @param   thrq    线程队列指针
- * @retval  true    队列空
- * @retval  false   队列不空
+ *          len     预留的缓存长度（消息的最大长度）
+ *          timeout 队列满时的等待超时，单位为秒，0表示一直阻塞直到队列有空位为止（超时返回ETIMEDOUT）
+ *          flags   阻塞标志：0表示阻塞，THRQ_NOWAIT表示不阻塞（含义与thrq_send_timeout相同）
+ *
+ * @return  成功返回缓存指针，失败返回NULL并设置errno
+ *
+ * @attention   每次预留都必须有且只有一次thrq_send_commit或thrq_send_cancel与之对应；
+ *              链表模式下未提交的预留计入队列容量；
+ *              单生产者单消费者模式下，同一时刻只能有一个未提交的预留；
+ *              多生产者多消费者模式下，预留后迟迟不提交会阻塞后续消息的接收
  */
-bool thrq_empty(thrq_cb_t *thrq)
+void* thrq_send_reserve(thrq_cb_t *thrq, size_t len, double timeout, int flags)
 {
-    if (thrq == NULL) {
-        return true;
+    if (thrq == NULL || len == 0) {
+        errno = EINVAL;
+        return NULL;
     }
-    mtx_lock(&thrq->lock);
-    bool empty = THRQ_EMPTY(thrq);
+    if (thrq->ring) {
+        double deadline = (timeout > 0) ? monotime() + timeout : 0;
+        thrq_slot_t *slot = thrq_ring_reserve(thrq, len, deadline, flags);
+        return slot ? slot->data : NULL;
+    }
+
+    if (thrq_lock_space(thrq, timeout, flags) != 0)
+        return NULL;
+    thrq_elm_t *elm = thrq_elm_alloc(thrq, len);
+    if (elm == NULL) {
+        int ec = errno;
+        mtx_unlock(&thrq->lock);
+        errno = ec;
+        return NULL;
+    }
+    thrq->reserved++;   // counted against the capacity until commit or cancel
     mtx_unlock(&thrq->lock);
-    return empty;
+    return elm->data;
 }
 
 /**
- * @brief   队列元素个数（或者有多少块数据）
+ * @brief   发送thrq_send_reserve预留的缓存中的消息
  * @param   thrq    线程队列指针
- * @return  返回队列元素个数，如果参数为NULL，则返回0
+ *          data    thrq_send_reserve返回的缓存指针
+ *          len     消息的实际长度，不能超过预留的长度
+ *
+ * @return  成功返回0，失败返回-1并设置errno
+ *
+ * @note    len超过预留的长度时预留被放弃（同thrq_send_cancel），返回LIB_ERRNO_MBLK_SHORT
  */
-int thrq_count(thrq_cb_t *thrq)
+int thrq_send_commit(thrq_cb_t *thrq, void *data, size_t len)
 {
-    if (thrq == NULL) {
+    if (thrq == NULL || data == NULL || len == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (thrq->ring) {
+        if (len > thrq->ring->slot_size) {
+            thrq_send_cancel(thrq, data);
+            errno = LIB_ERRNO_MBLK_SHORT;
+            return -1;
+        }
+        thrq_ring_commit(thrq, THRQ_DATA_SLOT(data), len);
+        thrq_ring_done(thrq, false, 1);
+        thrq_efd_notify(thrq);
         return 0;
     }
+
+    thrq_elm_t *elm = THRQ_DATA_ELM(data);
+    if (len > THRQ_ELM_LEN(elm)) {     // reserved length
+        thrq_send_cancel(thrq, data);
+        errno = LIB_ERRNO_MBLK_SHORT;
+        return -1;
+    }
     mtx_lock(&thrq->lock);
-    int count = thrq->count;
-    mtx_unlock(&thrq->lock);
-    return count;
+    elm->len = len | (elm->len & THRQ_ELM_STAMPED);
+    thrq->reserved--;
+    thrq_link(thrq, elm, THRQ_PRIO_NORMAL);
+    bool wake = (thrq->nwait > 0);
+    thrq_unlock(thrq);
+    thrq_efd_notify(thrq);
+
+    int res;
+    if (wake && (res = cnd_signal(&thrq->cond)) != 0) {
+        errno = res;
+        return -1;
+    }
+    return 0;
 }
 
 /**
- * @brief   内部函数，删除队列元素
+ * @brief   放弃thrq_send_reserve预留的缓存，不发送任何消息
  * @param   thrq    线程队列指针
- *          elm     要删除的元素
+ *          data    thrq_send_reserve返回的缓存指针
  *
  * @return  成功返回0，失败返回-1并设置errno
+ *
+ * @note    链表模式下释放预留的元素；环形队列模式下槽已经占住了队列中的位置，
+ *          因此以长度0提交，接收方跳过该槽（队列在此之前可能因该槽而显示为非空）
  */
-static int thrq_remove(thrq_cb_t *thrq, thrq_elm_t *elm)
+int thrq_send_cancel(thrq_cb_t *thrq, void *data)
 {
-    if (thrq == NULL || elm == NULL) {
+    if (thrq == NULL || data == NULL) {
         errno = EINVAL;
         return -1;
     }
+    if (thrq->ring) {
+        thrq_ring_commit(thrq, THRQ_DATA_SLOT(data), 0);
+        thrq_ring_wake(thrq->ring, false, 1);      // a parked receiver skips the hole
+        return 0;
+    }
 
     mtx_lock(&thrq->lock);
-    TAILQ_REMOVE(&thrq->head, elm, entry);
-    if (thrq->mpool)
-        mpool_free(thrq->mpool, elm);
-    else
-        free(elm);
-    if (thrq->count > 0) {
-        thrq->count--;
-    }
+    thrq_elm_free(thrq, THRQ_DATA_ELM(data));
+    thrq->reserved--;
+    if (thrq->nwait_send > 0)
+        cnd_signal(&thrq->space);
     mtx_unlock(&thrq->lock);
     return 0;
 }
 
 /**
- * @brief   内部函数，插入元素到队列
- * @param   thrq    线程队列指针
- *          data    插入的数据指针
- *          len     插入的数据长度
+ * @brief   从队列中借出一条消息，调用者直接读取队列中的数据，用完后通过thrq_release归还，省去一次拷贝
+ * @param   thrq        线程队列指针
+ *          len         输出消息的长度
+ *          timeout     接收超时，单位为秒，0表示一直阻塞直到收到数据为止
+ *          flags       阻塞标志：0表示阻塞，THRQ_NOWAIT表示不阻塞（含义与thrq_receive相同）
  *
- * @return  成功返回0，失败返回-1并设置errno
+ * @return  成功返回消息数据指针，失败返回NULL并设置errno（超时为ETIMEDOUT）
+ *
+ * @attention   每条借出的消息都必须通过thrq_release归还；
+ *              环形队列模式下，借出的槽在归还之前不能被生产者复用，长时间不归还会使队列变满；
+ *              单生产者单消费者模式下，同一时刻只能借出一条消息
  */
-static int thrq_insert_tail(thrq_cb_t *thrq, void *data, size_t len)
+void* thrq_receive_borrow(thrq_cb_t *thrq, size_t *len, double timeout, int flags)
 {
-    if (data == 0 || len == 0) {
+    if (thrq == NULL || len == NULL) {
         errno = EINVAL;
-        return -1;
+        return NULL;
     }
-
-    mtx_lock(&thrq->lock);
-    if (thrq->count >= THRQ_MAX_SIZE) {
-        mtx_unlock(&thrq->lock);
-        errno = LIB_ERRNO_QUE_FULL;
-        return -1;
+    if (thrq->ring) {
+        thrq_slot_t *slot = thrq_ring_borrow(thrq, timeout, flags);
+        if (slot == NULL) {
+            thrq_efd_clear(thrq);
+            return NULL;
+        }
+        *len = slot->len;
+        return slot->data;
     }
 
-    thrq_elm_t *elm;
-    if (thrq->mpool)
-        elm = (thrq_elm_t*)mpool_malloc(thrq->mpool, THRQ_BLOCK_SIZE(len));
-    else
-        elm = (thrq_elm_t*)malloc(THRQ_BLOCK_SIZE(len));
-
-    if (elm == 0) {
-        int ec = errno;             // backup errno
-        mtx_unlock(&thrq->lock);    // errno may be modified
-        errno = ec;
-        return -1;
+    if (thrq_lock_wait(thrq, timeout, flags) != 0) {
+        thrq_efd_clear(thrq);
+        return NULL;
     }
-    memcpy(elm->data, data, len);
-    elm->len = len;
-    TAILQ_INSERT_TAIL(&thrq->head, elm, entry);
-    thrq->count++;
 
-    mtx_unlock(&thrq->lock);
-    return 0;
+    thrq_elm_t *elm = THRQ_FIRST(thrq);
+    thrq_unlink(thrq, elm);
+    thrq_unlock(thrq);
+    thrq_efd_clear(thrq);
+
+    *len = THRQ_ELM_LEN(elm);
+    return elm->data;
 }
 
 /**
- * @brief   销毁线程队列
+ * @brief   归还thrq_receive_borrow借出的消息
  * @param   thrq    线程队列指针
- * @return  void
+ *          data    thrq_receive_borrow返回的消息数据指针
+ *
+ * @return  成功返回0，失败返回-1并设置errno
  */
-void thrq_destroy(thrq_cb_t *thrq)
+int thrq_release(thrq_cb_t *thrq, void *data)
 {
-    if (thrq) {
-        mtx_lock(&thrq->lock);
-        cnd_destroy(&thrq->cond);
-        while (!THRQ_EMPTY(thrq)) {
-            thrq_remove(thrq, THRQ_FIRST(thrq));
-        }
-        thrq->mpool = NULL;
-        mtx_unlock(&thrq->lock);
-
-        mtx_destroy(&thrq->lock);
+    if (thrq == NULL || data == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (thrq->ring) {
+        thrq_ring_release(thrq, THRQ_DATA_SLOT(data));
+        thrq_ring_done(thrq, true, 1);
+        thrq_efd_clear(thrq);
+        return 0;
     }
+
+    mtx_lock(&thrq->lock);
+    thrq_elm_free(thrq, THRQ_DATA_ELM(data));
+    mtx_unlock(&thrq->lock);
+    return 0;
 }
 
 /**
- * @brief   以阻塞或非阻塞方式发送队列消息
+ * @brief   批量发送队列消息，整批消息只加一次锁（链表模式）、只唤醒一次接收方
  * @param   thrq    线程队列指针
- *          data    发送的数据指针
- *          len     发送的数据长度
- *          flags   阻塞标志：0表示阻塞，THRQ_NOWAIT表示不阻塞（阻塞是指在加锁时锁被其他线程占用）
+ *          iov     消息数组，每个元素是一条消息
+ *          iovcnt  消息条数
+ *          flags   阻塞标志：0表示阻塞，THRQ_NOWAIT表示不阻塞（含义与thrq_send相同）
  *
- * @return  成功返回0，失败返回-1并设置errno
+ * @return  成功返回实际发送的消息条数（至少为1），失败返回-1并设置errno
+ *
+ * @note    队列满（或内存不足）时只发送前面的部分消息，返回值小于iovcnt；
+ *          环形队列模式下只在第一条消息上阻塞等待空槽
  */
-int thrq_send(thrq_cb_t *thrq, void *data, size_t len, int flags)
+int thrq_send_many(thrq_cb_t *thrq, const struct iovec *iov, int iovcnt, int flags)
 {
-    if (thrq == NULL || data == NULL || len == 0) {
+    if (thrq == NULL || iov == NULL || iovcnt <= 0) {
         errno = EINVAL;
         return -1;
     }
-
-    int lock_res;
-    if (flags == THRQ_NOWAIT) {
-        if (mtx_trylock(&thrq->lock) == thrd_busy) {
+    for (int i=0; i<iovcnt; i++) {
+        if (iov[i].iov_base == NULL || iov[i].iov_len == 0) {
+            errno = EINVAL;
             return -1;
         }
-    } else {
-        mtx_lock(&thrq->lock);
     }
-    if (thrq_insert_tail(thrq, data, len) != 0) {
-        mtx_unlock(&thrq->lock);
+
+    int n = 0;
+    if (thrq->ring) {
+        for (; n<iovcnt; n++) {
+            thrq_slot_t *slot = thrq_ring_reserve(thrq, iov[n].iov_len, 0, n == 0 ? flags : THRQ_NOWAIT);
+            if (slot == NULL)
+                break;
+            memcpy(slot->data, iov[n].iov_base, iov[n].iov_len);
+            thrq_ring_commit(thrq, slot, iov[n].iov_len);
+        }
+        if (n == 0)
+            return -1;
+        thrq_ring_done(thrq, false, n);
+        thrq_efd_notify(thrq);
+        return n;
+    }
+
+    if (thrq_lock_space(thrq, 0, flags) != 0)
         return -1;
+    for (; n<iovcnt; n++) {
+        if (thrq_insert_tail(thrq, iov[n].iov_base, iov[n].iov_len, THRQ_PRIO_NORMAL) != 0)
+            break;
     }
-    mtx_unlock(&thrq->lock);
+    int ec = errno;
+    int nwait = thrq->nwait;
+    thrq_unlock(thrq);
+    if (n == 0) {
+        errno = ec;
+        return -1;
+    }
+    thrq_efd_notify(thrq);
 
-    int res;
-    if ((res = cnd_signal(&thrq->cond)) != 0) {
+    int res = 0;
+    if (nwait > 0)
+        res = (n == 1 || nwait == 1) ? cnd_signal(&thrq->cond) : cnd_broadcast(&thrq->cond);
+    if (res != 0) {
         errno = res;
         return -1;
     }
-    return 0;
+    return n;
 }
 
 /**
- * @brief   以阻塞或非阻塞方式接收队列消息
+ * @brief   批量接收队列消息，整批消息只加一次锁（链表模式）、只唤醒一次发送方
  * @param   thrq        线程队列指针
- *          buf         接收缓存
- *          max_size    接收缓存的大小
+ *          iov         接收缓存数组，每个元素接收一条消息；返回时iov_len被改为实际收到的长度
+ *          iovcnt      最多接收的消息条数
+ *          maxbytes    最多接收的字节数，累计收到的长度达到maxbytes后不再接收下一条，0表示不限制
  *          timeout     接收超时，单位为秒，0表示一直阻塞直到收到数据为止
- *          flags       阻塞标志：0表示阻塞，THRQ_NOWAIT表示不阻塞(即锁被占用或者无数据时立即返回)
+ *          flags       阻塞标志：0表示阻塞，THRQ_NOWAIT表示不阻塞（含义与thrq_receive相同）
  *
- * @return  成功返回实际收到的数据长度,失败返回-1并设置错误码
+ * @return  成功返回实际收到的消息条数（至少为1），失败返回-1并设置errno
  *
- * @note    当函数收到数据或者发送错误时，将从阻塞状态返回；
- *          通过检查errno是否为 ETIMEDOUT 可以判断函数是否是超时返回
- * @par     举例：
- * @code
- * int num;
- * double tout = 3.0;
- * for (;;) {
- *     if ((num = thrq_receive(thrq, buf, bufsize, tout, 0)) == -1) {
- *         if (errno == ETIMEDOUT) {
- *             printf("receive timeout %.1fs\n", tout);
- *             continue;
- *         }
- *     }
- * }
- * @endcode
+ * @note    只在第一条消息上阻塞等待，之后取完队列中已有的消息（不超过iovcnt条和maxbytes字节）即返回；
+ *          消息长度超过接收缓存时被截断，与thrq_receive相同
  */
-int thrq_receive(thrq_cb_t *thrq, void *buf, size_t bufsize, double timeout, int flags)
+int thrq_receive_many(thrq_cb_t *thrq, struct iovec *iov, int iovcnt, size_t maxbytes,
+                      double timeout, int flags)
 {
-    if (thrq == NULL || buf == NULL || bufsize == 0) {
+    if (thrq == NULL || iov == NULL || iovcnt <= 0) {
         errno = EINVAL;
         return -1;
     }
-
-    int res = 0;
-    struct timespec ts;
-    if (timeout > 0) {
-        timespec_get(&ts, TIME_MONO);
-        // ok, max_long_int = 2.1s > (1s + 1s)
-        ts.tv_nsec = (long)((timeout - (long)timeout) * 1000000000L) + ts.tv_nsec;
-        ts.tv_sec = (time_t)timeout + ts.tv_sec + (ts.tv_nsec / 1000000000L);
-        ts.tv_nsec = ts.tv_nsec % 1000000000L;
-    }
-
-    int lock_res;
-    if (flags == THRQ_NOWAIT) {
-        if (mtx_trylock(&thrq->lock) == thrd_busy) {
+    for (int i=0; i<iovcnt; i++) {
+        if (iov[i].iov_base == NULL || iov[i].iov_len == 0) {
+            errno = EINVAL;
             return -1;
         }
-    } else {
-        mtx_lock(&thrq->lock);
     }
 
-    if (flags != THRQ_NOWAIT) {
-        /* break when error occured or data receive */
-        while (res == 0 && thrq->count == 0) {
-            if (timeout > 0) {
-                res = cnd_timedwait(&thrq->cond, &thrq->lock, &ts);
-            } else {
-                res = cnd_wait(&thrq->cond, &thrq->lock);
-            }
-        }
-        if (res != 0) {
-            mtx_unlock(&thrq->lock);
-            if (res == thrd_timeout)
-                errno = ETIMEDOUT;
-            return -1;      // errno may be the ETIMEDOUT
+    int n = 0;
+    size_t bytes = 0;
+    if (thrq->ring) {
+        for (; n<iovcnt && (maxbytes == 0 || bytes < maxbytes); n++) {
+            thrq_slot_t *slot = thrq_ring_borrow(thrq, timeout, n == 0 ? flags : THRQ_NOWAIT);
+            if (slot == NULL)
+                break;
+            size_t cpsize = (iov[n].iov_len < slot->len) ? iov[n].iov_len : slot->len;
+            memcpy(iov[n].iov_base, slot->data, cpsize);
+            thrq_ring_release(thrq, slot);
+            iov[n].iov_len = cpsize;
+            bytes += cpsize;
         }
-    } else {
-        if (thrq->count == 0) {
-            errno = LIB_ERRNO_QUE_EMPTY;
-            mtx_unlock(&thrq->lock);
+        thrq_efd_clear(thrq);
+        if (n == 0)
             return -1;
-        }
+        thrq_ring_done(thrq, true, n);
+        return n;
     }
 
-    thrq_elm_t *elm = THRQ_FIRST(thrq);
-    size_t cpsize = (bufsize < elm->len) ? bufsize : elm->len;
-    memcpy(buf, elm->data, cpsize);
-    thrq_remove(thrq, elm);
+    if (thrq_lock_wait(thrq, timeout, flags) != 0) {
+        thrq_efd_clear(thrq);
+        return -1;
+    }
 
-    mtx_unlock(&thrq->lock);
-    return cpsize;
+    for (; n<iovcnt && !THRQ_EMPTY(thrq) && (maxbytes == 0 || bytes < maxbytes); n++) {
+        thrq_elm_t *elm = THRQ_FIRST(thrq);
+        size_t cpsize = (iov[n].iov_len < THRQ_ELM_LEN(elm)) ? iov[n].iov_len : THRQ_ELM_LEN(elm);
+        memcpy(iov[n].iov_base, elm->data, cpsize);
+        thrq_detach(thrq, elm);
+        thrq_elm_free(thrq, elm);
+        iov[n].iov_len = cpsize;
+        bytes += cpsize;
+    }
+    thrq_count_add(thrq, -n);       // one count update and one wake of the senders per batch
+
+    thrq_unlock(thrq);
+    thrq_efd_clear(thrq);
+    return n;
 }
 
 #ifdef __cplusplus
 }
 #endif
-
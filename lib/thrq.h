@@ -2,22 +2,40 @@
  * @file    thrq.h
  * @author  ln
  * @brief   通过队列在线程间发送与接收数据；发送的数据会被拷贝到队列暂存，直到数据被收取
+ *
+ *          默认的队列是互斥锁 + 条件变量保护的链表；也可以通过thrq_init_spsc初始化为单生产者单消费者的环形队列，
+ *          环形队列由2的幂个固定大小的槽构成，收发都不加锁，只有在队列空或满时才通过futex阻塞；
+ *          多个线程同时收发时可以通过thrq_init_mpmc初始化为多生产者多消费者的环形队列（每个槽带序号）
+ *
+ *          除了拷贝式的thrq_send/thrq_receive，还可以通过thrq_send_reserve/thrq_send_commit直接在队列中构造消息，
+ *          通过thrq_receive_borrow/thrq_release直接读取队列中的消息，省去收发两端的拷贝
+ *
+ *          链表模式下可以通过thrq_send_prio把控制消息发送到高优先级通道，接收时总是先取最高的非空通道
+ *
+ *          thrq_eventfd为队列创建一个在队列非空时可读的描述符，从而可以在一个epoll循环中同时等待多个队列、socket和tty；
+ *          只等待多个队列时可以直接使用thrq_select/thrq_wait_any
+ *
+ *          thrq_set_stats打开统计后，发送时为消息打上时间戳，接收时把排队时间记入对数-线性直方图，
+ *          并记录队列长度的最高水位；thrq_stats不加锁读取（及清零）p50/p99/p999/max，可以在生产环境常开
  */
 
 #ifndef __THR_QUEUE__
 #define __THR_QUEUE__
 
 #include <stdbool.h>
+#include <sys/uio.h>
 #include "sysque.h"
 #include "threads_c11.h"
 #include "err.h"
 #include "mpool.h"
+#include "mslab.h"
+#include "arena.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-/// 对内存的使用做限制，避免内存池在自增长模式下向系统无限申请内存
+/// 链表模式下队列的默认容量，对内存的使用做限制，避免内存池在自增长模式下向系统无限申请内存
 #define THRQ_MAX_SIZE           65536
 
 /**
@@ -43,39 +61,166 @@ extern "C" {
  */
 typedef struct __thrq_elm {
     TAILQ_ENTRY(__thrq_elm) entry;      ///< 链表元素的表头
-    size_t                  len;        ///< 元素内的数据长度
+    size_t                  len;        ///< 元素内的数据长度，最高位表示元素前面带有入队时刻（THRQ_STAMP_SIZE）
     unsigned char           data[];     ///< 元素内的数据区
 } thrq_elm_t;
 
 typedef TAILQ_HEAD(__thrq_head, __thrq_elm) thrq_head_t;
 
+/// 优先级通道数（链表模式），不超过32
+#define THRQ_PRIO_NUM           4
+/// 普通优先级，thrq_send使用的优先级
+#define THRQ_PRIO_NORMAL        0
+/// 最高优先级
+#define THRQ_PRIO_URGENT        (THRQ_PRIO_NUM - 1)
+
+/// 缓存行大小，环形队列中生产者与消费者各自读写的字段分处不同的缓存行
+#define THRQ_CACHELINE          64
+
+enum {
+    THRQ_MODE_LIST = 0,         ///< 链表模式：互斥锁 + 条件变量保护的链表，长度不限（THRQ_MAX_SIZE）
+    THRQ_MODE_SPSC,             ///< 单生产者单消费者环形队列：无锁，空或满时通过futex阻塞
+    THRQ_MODE_MPMC              ///< 多生产者多消费者环形队列：无锁（每个槽带序号），空或满时通过futex阻塞
+};
+
+/// 环形队列的槽
+typedef struct {
+    size_t                  seq;        ///< 槽的序号（多生产者多消费者模式使用）
+    size_t                  len;        ///< 槽内的数据长度
+    uint64_t                stamp;      ///< 入队时刻（纳秒，单调时钟），未打开统计时为0
+    unsigned char           data[];     ///< 槽的数据区
+} thrq_slot_t;
+
+/// 环形队列
+typedef struct {
+    size_t      tail __attribute__((aligned(THRQ_CACHELINE)));  ///< 写入位置，由生产者修改
+    size_t      head_cache;                                     ///< 生产者缓存的读取位置，减少对head的访问（仅SPSC）
+    size_t      head __attribute__((aligned(THRQ_CACHELINE)));  ///< 读取位置，由消费者修改
+    size_t      tail_cache;                                     ///< 消费者缓存的写入位置，减少对tail的访问（仅SPSC）
+    uint32_t    futex[2] __attribute__((aligned(THRQ_CACHELINE))); ///< 等待字，[0]接收方等数据，[1]发送方等空槽，唤醒该方向时加1
+    uint32_t    nwait[2];                                          ///< 两个方向上正在等待的线程数
+    size_t      mask __attribute__((aligned(THRQ_CACHELINE)));  ///< 槽数 - 1
+    size_t      slot_size;                                      ///< 每个槽可容纳的最大数据长度
+    size_t      stride;                                         ///< 相邻两槽的间距
+    unsigned char   *slots;                                     ///< 槽区
+} thrq_ring_t;
+
+/// 水位回调，high为true表示队列长度达到高水位，false表示回落到低水位
+typedef void (*thrq_mark_cb_t)(void *arg, bool high);
+
+/// 直方图每个2的幂区间再等分的份数（2的幂），相对误差不超过 1/THRQ_HIST_SUB
+#define THRQ_HIST_SUB_BITS      4
+#define THRQ_HIST_SUB           (1 << THRQ_HIST_SUB_BITS)
+/// 直方图的桶数，覆盖0 ~ 2^64-1纳秒
+#define THRQ_HIST_BUCKETS       ((64 - THRQ_HIST_SUB_BITS + 1) * THRQ_HIST_SUB)
+
+/// 排队时间直方图（对数-线性分桶），所有字段都通过原子操作读写
+typedef struct {
+    uint64_t                sum;        ///< 排队时间之和（纳秒）
+    uint64_t                max;        ///< 最长排队时间（纳秒）
+    int                     depth_max;  ///< 队列长度的最高水位
+    uint64_t                bucket[THRQ_HIST_BUCKETS];  ///< 各桶的消息条数
+} thrq_hist_t;
+
+/// thrq_stats输出的统计结果，时间单位为纳秒
+typedef struct {
+    uint64_t                count;      ///< 记录的消息条数
+    uint64_t                mean;       ///< 平均排队时间
+    uint64_t                p50;        ///< 排队时间的50%分位数
+    uint64_t                p99;        ///< 排队时间的99%分位数
+    uint64_t                p999;       ///< 排队时间的99.9%分位数
+    uint64_t                max;        ///< 最长排队时间
+    int                     depth_max;  ///< 队列长度的最高水位
+} thrq_stats_t;
+
 /* the queue control block */
 typedef struct {
     mpool_t             *mpool;         ///< 内存池指针
+    mslab_t             *mslab;         ///< 多规格分配器指针，不为NULL时优先于mpool
+    arena_t             *arena;         ///< 线性分配器指针，不为NULL时优先于mslab和mpool
 
-    thrq_head_t         head;           ///< 数据队列
+    thrq_head_t         head[THRQ_PRIO_NUM];    ///< 数据队列，每个优先级一个通道
+    unsigned            prio_mask;      ///< 非空通道的位图
     mtx_t               lock;           ///< 互斥锁
     cnd_t               cond;           ///< 条件变量
 
     int                 count;          ///< 当前队列里的元素个数
+
+    int                 mode;           ///< 队列模式，THRQ_MODE_xxx
+    thrq_ring_t         *ring;          ///< 环形队列，链表模式下为NULL
+
+    int                 efd;            ///< 可读通知描述符(eventfd)，未启用时为-1
+    int                 efd_armed;      ///< eventfd是否已被置为可读
+
+    int                 spin;           ///< 接收方休眠之前的自旋策略：0不自旋，大于0为固定次数，THRQ_SPIN_ADAPTIVE为自适应
+    int                 spin_avg;       ///< 自适应模式下最近成功自旋次数的平均值
+    int                 nwait;          ///< 在条件变量上休眠的接收方个数（链表模式），为0时发送方不调用cnd_signal
+
+    int                 capacity;       ///< 链表模式下的容量，默认为THRQ_MAX_SIZE
+    cnd_t               space;          ///< 条件变量，队列满时发送方在其上等待
+    int                 nwait_send;     ///< 因队列满而等待的发送方个数
+    int                 reserved;       ///< 已预留而尚未提交的元素个数（链表模式），计入容量
+
+    int                 high_mark;      ///< 高水位线
+    int                 low_mark;       ///< 低水位线
+    thrq_mark_cb_t      mark_cb;        ///< 水位回调，NULL表示未启用
+    void                *mark_arg;      ///< 水位回调的参数
+    int                 marked;         ///< 是否处于高水位（已调用高水位回调而尚未回落）
+    int                 mark_busy;      ///< 是否有线程正在调用水位回调（保证回调串行、交替，且不持有队列锁）
+
+    thrq_hist_t         *hist;          ///< 排队时间直方图，第一次打开统计时分配，销毁队列时释放
+    int                 hist_on;        ///< 是否打开统计
 } thrq_cb_t;
 
 #define THRQ_BLOCK_SIZE(data_size)      (sizeof(thrq_elm_t) + (data_size))
+/// 打开统计时每个元素前额外分配的入队时刻，用mpool分配元素时块大小应为THRQ_STAMP_SIZE + THRQ_BLOCK_SIZE(data_size)
+#define THRQ_STAMP_SIZE                 sizeof(uint64_t)
 
 #define THRQ_INIT(q)                    thrq_init(q,0)
 #define THRQ_INIT_MP(q,m)               thrq_init(q,m)
+#define THRQ_INIT_SLAB(q,s)             thrq_init_slab(q,s)
+#define THRQ_INIT_ARENA(q,a)            thrq_init_arena(q,a)
+#define THRQ_INIT_SPSC(q,s,n)           thrq_init_spsc(q,s,n)
+#define THRQ_INIT_MPMC(q,s,n)           thrq_init_mpmc(q,s,n)
 
 #define THRQ_NOWAIT                     1
 
+#define THRQ_SPIN_ADAPTIVE              (-1)    ///< 根据最近的消息间隔自动调整自旋次数
+#define THRQ_SPIN_MAX                   4096    ///< 自适应模式下的最大自旋次数
+
 extern int          thrq_init(thrq_cb_t *thrq, mpool_t *mp);
+extern int          thrq_init_slab(thrq_cb_t *thrq, mslab_t *slab);
+extern int          thrq_init_arena(thrq_cb_t *thrq, arena_t *arena);
+extern int          thrq_init_spsc(thrq_cb_t *thrq, size_t slot_size, size_t nslots);
+extern int          thrq_init_mpmc(thrq_cb_t *thrq, size_t slot_size, size_t nslots);
 extern thrq_cb_t*   thrq_new(thrq_cb_t **thrq, mpool_t *mp);
+extern thrq_cb_t*   thrq_new_arena(thrq_cb_t **thrq, arena_t *arena);
 extern void         thrq_destroy(thrq_cb_t *thrq);
 
 extern bool         thrq_empty(thrq_cb_t *thrq);
 extern int          thrq_count(thrq_cb_t *thrq);
+extern int          thrq_eventfd(thrq_cb_t *thrq);
+extern int          thrq_select(thrq_cb_t *thrqs[], int n, bool ready[], double timeout, int flags);
+extern int          thrq_wait_any(thrq_cb_t *thrqs[], int n, double timeout);
+extern int          thrq_set_spin(thrq_cb_t *thrq, int spin);
+extern int          thrq_set_capacity(thrq_cb_t *thrq, int capacity);
+extern int          thrq_set_watermark(thrq_cb_t *thrq, int high, int low, thrq_mark_cb_t cb, void *arg);
+extern int          thrq_set_stats(thrq_cb_t *thrq, bool enable);
+extern int          thrq_stats(thrq_cb_t *thrq, thrq_stats_t *stats, bool reset);
 
 extern int          thrq_send(thrq_cb_t *thrq, void *data, size_t len, int flags);
+extern int          thrq_send_timeout(thrq_cb_t *thrq, void *data, size_t len, double timeout, int flags);
+extern int          thrq_send_prio(thrq_cb_t *thrq, void *data, size_t len, int prio, int flags);
 extern int          thrq_receive(thrq_cb_t *thrq, void *buf, size_t bufsize, double timeout, int flags);
+extern int          thrq_send_many(thrq_cb_t *thrq, const struct iovec *iov, int iovcnt, int flags);
+extern int          thrq_receive_many(thrq_cb_t *thrq, struct iovec *iov, int iovcnt, size_t maxbytes,
+                                      double timeout, int flags);
+
+extern void*        thrq_send_reserve(thrq_cb_t *thrq, size_t len, double timeout, int flags);
+extern int          thrq_send_commit(thrq_cb_t *thrq, void *data, size_t len);
+extern int          thrq_send_cancel(thrq_cb_t *thrq, void *data);
+extern void*        thrq_receive_borrow(thrq_cb_t *thrq, size_t *len, double timeout, int flags);
+extern int          thrq_release(thrq_cb_t *thrq, void *data);
 
 #ifdef __cplusplus
 }